@@ -0,0 +1,310 @@
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_query_stack UPDATE TO '1.1.0'" to load this file. \quit
+
+-- Новые аргументы и колонки pg_query_stack меняют сигнатуру, поэтому функцию пересоздаём
+DROP FUNCTION public.pg_query_stack(int);
+
+CREATE FUNCTION public.pg_query_stack(_skip_count int DEFAULT 1, _frame_kind text DEFAULT NULL, _collapse boolean DEFAULT false)
+	RETURNS TABLE (frame_number integer, query_text text, frame_kind text, trigger_name text, trigger_relation regclass,
+	               repeat_count integer)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE FUNCTION public.pg_query_stack_profile()
+	RETURNS TABLE (path_hash bigint, parent_path_hash bigint, plan_hash bigint, path_plans integer,
+	               depth integer, frame_kind text, query_text text,
+	               calls bigint, total_time float8, self_time float8, rows bigint,
+	               jit_functions bigint, jit_generation_time float8, jit_inlining_time float8,
+	               jit_optimization_time float8, jit_emission_time float8, jit_dominates boolean,
+	               warmup_calls bigint, warmup_time float8,
+	               p50_time float8, p95_time float8, p99_time float8, max_time float8)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE FUNCTION public.pg_query_stack_function_warmup()
+	RETURNS TABLE (func regprocedure, compiles bigint, warmup_time float8, steady_calls bigint, steady_time float8)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE FUNCTION public.pg_query_stack_profile_reset()
+	RETURNS void
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE FUNCTION public.pg_query_stack_active_frames()
+	RETURNS TABLE (pid integer, dbid oid, frame_number integer, path_hash bigint, text_hash bigint, frame_start timestamptz)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE VIEW public.pg_query_stack_duplicates AS
+SELECT
+    dbid,
+    path_hash,
+    text_hash,
+    min(frame_number)                     AS frame_number,
+    count(DISTINCT pid)                   AS backends,
+    min(frame_start)                      AS oldest_start,
+    array_agg(pid ORDER BY frame_start)   AS pids
+FROM public.pg_query_stack_active_frames()
+GROUP BY dbid, path_hash, text_hash
+HAVING count(DISTINCT pid) > 1;
+
+CREATE FUNCTION public.pg_query_stack_writers()
+	RETURNS TABLE (dbid oid, relid oid, operation text, path_hash bigint, stack text,
+	               calls bigint, rows bigint, total_time float8)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE FUNCTION public.pg_query_stack_writers_reset()
+	RETURNS void
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION public.pg_query_stack_writers_reset() FROM PUBLIC;
+
+CREATE VIEW public.pg_query_stack_table_writers AS
+SELECT
+    relid::regclass AS relation,
+    operation,
+    path_hash,
+    stack,
+    calls,
+    rows,
+    total_time
+FROM public.pg_query_stack_writers()
+WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database());
+
+CREATE FUNCTION public.pg_query_stack_trace_start(max_events integer DEFAULT 100000)
+	RETURNS void
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE FUNCTION public.pg_query_stack_trace_stop()
+	RETURNS json
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE FUNCTION public.pg_query_stack_trace_stop(filename text)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME', 'pg_query_stack_trace_stop_to_file'
+	LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION public.pg_query_stack_trace_stop(text) FROM PUBLIC;
+
+CREATE FUNCTION public.pg_query_stack_explain(pid integer, frame integer DEFAULT NULL)
+	RETURNS boolean
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION public.pg_query_stack_explain(integer, integer) FROM PUBLIC;
+
+
+CREATE FUNCTION public.pg_query_stack_shared_profile()
+	RETURNS TABLE (dbid oid, path_hash bigint, parent_path_hash bigint, plan_hash bigint,
+	               depth integer, frame_kind text, query_text text,
+	               calls bigint, total_time float8, self_time float8, rows bigint,
+	               p50_time float8, p95_time float8, p99_time float8, max_time float8,
+	               checked_calls bigint, error_factor float8, row_ratio float8, profile_dropped bigint)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE FUNCTION public.pg_query_stack_shared_profile_reset()
+	RETURNS void
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION public.pg_query_stack_shared_profile_reset() FROM PUBLIC;
+
+CREATE FUNCTION public.pg_query_stack_profile_windows(_windows integer DEFAULT NULL)
+	RETURNS TABLE (window_start timestamptz, is_current boolean, dbid oid, path_hash bigint, plan_hash bigint,
+	               calls bigint, total_time float8, self_time float8, rows bigint, window_dropped bigint)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE TABLE public.pg_query_stack_snapshot (
+    name        text PRIMARY KEY,
+    taken_at    timestamptz NOT NULL DEFAULT now(),
+    shared      boolean NOT NULL
+);
+
+CREATE TABLE public.pg_query_stack_snapshot_path (
+    name             text NOT NULL REFERENCES public.pg_query_stack_snapshot (name) ON DELETE CASCADE,
+    path_hash        bigint NOT NULL,
+    parent_path_hash bigint NOT NULL,
+    plans            integer NOT NULL,
+    calls            bigint NOT NULL,
+    total_time       float8 NOT NULL,
+    self_time        float8 NOT NULL,
+    rows             bigint NOT NULL,
+    PRIMARY KEY (name, path_hash)
+);
+
+-- Тексты хранятся один раз на путь вызовов, а не в каждом снимке
+CREATE TABLE public.pg_query_stack_snapshot_text (
+    path_hash   bigint PRIMARY KEY,
+    query_text  text
+);
+
+SELECT pg_catalog.pg_extension_config_dump('public.pg_query_stack_snapshot', '');
+SELECT pg_catalog.pg_extension_config_dump('public.pg_query_stack_snapshot_path', '');
+SELECT pg_catalog.pg_extension_config_dump('public.pg_query_stack_snapshot_text', '');
+
+CREATE FUNCTION public.pg_query_stack_profile_snapshot(_name text, _shared boolean DEFAULT true)
+    RETURNS integer
+AS
+$$
+DECLARE
+    _paths integer;
+BEGIN
+    INSERT INTO public.pg_query_stack_snapshot (name, shared) VALUES (_name, _shared);
+
+    WITH src AS (
+        SELECT path_hash, parent_path_hash, plan_hash, query_text, calls, total_time, self_time, rows
+        FROM public.pg_query_stack_shared_profile()
+        WHERE _shared
+          AND dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+        UNION ALL
+        SELECT path_hash, parent_path_hash, plan_hash, query_text, calls, total_time, self_time, rows
+        FROM public.pg_query_stack_profile()
+        WHERE NOT _shared
+    ),
+    paths AS (
+        INSERT INTO public.pg_query_stack_snapshot_path
+        SELECT _name, path_hash, min(parent_path_hash), count(DISTINCT plan_hash),
+               sum(calls), sum(total_time), sum(self_time), sum(rows)
+        FROM src
+        GROUP BY path_hash
+        RETURNING 1
+    ),
+    texts AS (
+        INSERT INTO public.pg_query_stack_snapshot_text AS t (path_hash, query_text)
+        SELECT DISTINCT ON (path_hash) path_hash, query_text
+        FROM src
+        ORDER BY path_hash, query_text NULLS LAST
+        ON CONFLICT (path_hash) DO UPDATE SET query_text = EXCLUDED.query_text
+            WHERE t.query_text IS NULL
+    )
+    SELECT count(*) INTO _paths FROM paths;
+
+    RETURN _paths;
+END
+$$ LANGUAGE plpgsql
+SECURITY DEFINER
+SET search_path = pg_catalog, pg_temp;
+
+-- Снимки хранят тексты всех пользователей базы: создаёт и читает их только владелец расширения и те, кому он выдаст права
+REVOKE ALL ON FUNCTION public.pg_query_stack_profile_snapshot(text, boolean) FROM PUBLIC;
+
+CREATE FUNCTION public.pg_query_stack_profile_diff(_a text, _b text, _order_by text DEFAULT 'self_time')
+    RETURNS TABLE (path_hash bigint, parent_path_hash bigint, query_text text,
+                   plans_a integer, plans_b integer,
+                   calls_a bigint, calls_b bigint, calls_diff bigint,
+                   total_time_a float8, total_time_b float8, total_time_diff float8,
+                   self_time_a float8, self_time_b float8, self_time_diff float8,
+                   rows_a bigint, rows_b bigint, rows_diff bigint,
+                   mean_time_a float8, mean_time_b float8, period_mean_time float8)
+AS
+$$
+#variable_conflict use_column
+BEGIN
+    IF _order_by NOT IN ('calls', 'total_time', 'self_time', 'rows') THEN
+        RAISE EXCEPTION 'unknown _order_by value "%"', _order_by
+            USING HINT = 'Use calls, total_time, self_time or rows.';
+    END IF;
+
+    RETURN QUERY
+    SELECT
+        d.*,
+        -- Среднее за период между снимками (если профиль между ними не очищался)
+        CASE WHEN d.calls_b > d.calls_a THEN d.total_time_diff / d.calls_diff END
+    FROM (
+        SELECT
+            coalesce(b.path_hash, a.path_hash) AS path_hash,
+            coalesce(b.parent_path_hash, a.parent_path_hash) AS parent_path_hash,
+            t.query_text,
+            a.plans AS plans_a, b.plans AS plans_b,
+            coalesce(a.calls, 0) AS calls_a, coalesce(b.calls, 0) AS calls_b,
+            coalesce(b.calls, 0) - coalesce(a.calls, 0) AS calls_diff,
+            coalesce(a.total_time, 0) AS total_time_a, coalesce(b.total_time, 0) AS total_time_b,
+            coalesce(b.total_time, 0) - coalesce(a.total_time, 0) AS total_time_diff,
+            coalesce(a.self_time, 0) AS self_time_a, coalesce(b.self_time, 0) AS self_time_b,
+            coalesce(b.self_time, 0) - coalesce(a.self_time, 0) AS self_time_diff,
+            coalesce(a.rows, 0) AS rows_a, coalesce(b.rows, 0) AS rows_b,
+            coalesce(b.rows, 0) - coalesce(a.rows, 0) AS rows_diff,
+            a.total_time / nullif(a.calls, 0) AS mean_time_a, b.total_time / nullif(b.calls, 0) AS mean_time_b
+        FROM (SELECT * FROM public.pg_query_stack_snapshot_path WHERE name = _a) a
+        FULL JOIN (SELECT * FROM public.pg_query_stack_snapshot_path WHERE name = _b) b USING (path_hash)
+        LEFT JOIN public.pg_query_stack_snapshot_text t ON t.path_hash = coalesce(b.path_hash, a.path_hash)
+    ) d
+    ORDER BY abs(CASE _order_by
+                     WHEN 'calls' THEN d.calls_diff::float8
+                     WHEN 'total_time' THEN d.total_time_diff
+                     WHEN 'self_time' THEN d.self_time_diff
+                     WHEN 'rows' THEN d.rows_diff::float8
+                 END) DESC;
+END
+$$ LANGUAGE plpgsql STABLE
+SECURITY DEFINER
+SET search_path = pg_catalog, pg_temp;
+
+REVOKE ALL ON FUNCTION public.pg_query_stack_profile_diff(text, text, text) FROM PUBLIC;
+
+CREATE FUNCTION public.pg_query_stack_explain_nested(_query text, _options text DEFAULT NULL)
+	RETURNS SETOF text
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE FUNCTION public.pg_query_stack_sample_start(interval_ms integer DEFAULT 10, max_paths integer DEFAULT 10000)
+	RETURNS void
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE FUNCTION public.pg_query_stack_sample_stop()
+	RETURNS bigint
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE FUNCTION public.pg_query_stack_sample_report()
+	RETURNS TABLE (stack text, samples bigint)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE FUNCTION public.pg_query_stack_dynamic_plans(min_plans integer DEFAULT 100)
+	RETURNS TABLE (caller_path_hash bigint, caller_stack text, func regprocedure,
+	               query_hash bigint, query_text text,
+	               plans bigint, total_plan_time float8, mean_plan_time float8)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE FUNCTION public.pg_query_stack_horizon_blame()
+	RETURNS TABLE (pid integer, xid xid, xid_stack text, xid_time timestamptz,
+	               xmin xid, xmin_stack text, xmin_time timestamptz)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
+
+CREATE VIEW public.pg_query_stack_horizon AS
+SELECT
+    a.pid,
+    a.datname,
+    a.usename,
+    a.state,
+    a.xact_start,
+    a.backend_xid,
+    a.backend_xmin,
+    greatest(age(a.backend_xid), age(a.backend_xmin))       AS horizon_age,
+    CASE WHEN b.xid = a.backend_xid THEN b.xid_stack END    AS xid_stack,
+    CASE WHEN b.xid = a.backend_xid THEN b.xid_time END     AS xid_time,
+    CASE WHEN b.xmin = a.backend_xmin THEN b.xmin_stack END AS xmin_stack,
+    CASE WHEN b.xmin = a.backend_xmin THEN b.xmin_time END  AS xmin_time,
+    a.query
+FROM pg_catalog.pg_stat_activity a
+LEFT JOIN public.pg_query_stack_horizon_blame() b ON b.pid = a.pid
+WHERE a.backend_xid IS NOT NULL OR a.backend_xmin IS NOT NULL
+ORDER BY horizon_age DESC;
+
+CREATE FUNCTION public.pg_query_stack_misestimates(min_factor float8 DEFAULT 10, min_calls bigint DEFAULT 10)
+	RETURNS TABLE (path_hash bigint, plan_hash bigint, stack text, query_text text,
+	               calls bigint, checked_calls bigint,
+	               mean_estimated_rows float8, mean_actual_rows float8, error_factor float8, row_ratio float8)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE;
\ No newline at end of file
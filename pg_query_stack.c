@@ -4,14 +4,60 @@
  */
 
 #include "postgres.h"
+
+#include <ctype.h>
+#include <math.h>
+
 #include "fmgr.h"
 #include "funcapi.h"
+#include "miscadmin.h"
+#include "common/hashfn.h"
+#include "mb/pg_wchar.h"
+#include "parser/parsetree.h"
+#include "portability/instr_time.h"
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+#include "storage/backendid.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
 #include "executor/executor.h"
+#include "executor/spi.h"
+#include "jit/jit.h"
 #include "nodes/execnodes.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/planner.h"
+#include "utils/acl.h"
+#include "utils/backend_status.h"
 #include "utils/builtins.h"
+#include "lib/stringinfo.h"
 #include "utils/memutils.h"
 #include "utils/lsyscache.h"
+#include "utils/portal.h"
+#include "utils/resowner.h"
+#include "utils/rel.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/json.h"
+#include "utils/syscache.h"
+#include "utils/timeout.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#include "utils/varlena.h"
+#include "access/htup_details.h"
+#include "access/parallel.h"
+#include "access/transam.h"
 #include "access/xact.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_type.h"
+#include "commands/explain.h"
+#include "commands/trigger.h"
+#include "tcop/pquery.h"
+#include "plpgsql.h"
 
 /*
 Ключевое слово PG_MODULE_MAGIC используется для вставки специального "магического" блока информации в скомпилированную библиотеку расширения. 
@@ -28,12 +74,104 @@ PG_MODULE_MAGIC;
 */
 static List *Query_Stack = NIL;
 
+// Счётчик глубины стека: сколько кадров сейчас в Query_Stack (0 - пусто)
+static int Query_Stack_Depth = 0;
+
+/*
+    Вид кадра стека. Определяется один раз при добавлении кадра в ExecutorStart
+    по уже имеющимся у нас данным (глубина, активный портал, получатель результата, вызов PL/pgSQL),
+    поэтому никаких дополнительных обращений к каталогу не требует.
+*/
+typedef enum QueryStackFrameKind
+{
+    QSK_TOPLEVEL,       // запрос верхнего уровня (глубина 0)
+    QSK_NESTED,         // вложенный запрос, происхождение которого определить не удалось
+    QSK_TRIGGER,        // запрос из тела триггерной функции
+    QSK_SQL_FUNCTION,   // запрос из тела SQL-функции
+    QSK_SPI,            // запрос через SPI из PL-кода
+    QSK_CURSOR          // открытие курсора (DECLARE, OPEN)
+} QueryStackFrameKind;
+
+#define QSK_COUNT (QSK_CURSOR + 1)
+
+// Имена видов кадров, как они видны пользователю (колонка frame_kind и аргумент _frame_kind)
+static const char *const QueryStackFrameKindNames[QSK_COUNT] = {
+    "toplevel",
+    "nested",
+    "trigger",
+    "sql_function",
+    "spi",
+    "cursor"
+};
+
 // Структура для хранения копии запроса
 typedef struct QueryStackEntry
 {
     char *query_text;
+    QueryDesc *query_desc;          // QueryDesc кадра, по нему снимаем со стека именно свой кадр
+    SubTransactionId subid;         // подтранзакция, в которой кадр добавлен (для очистки при её откате)
+    int depth;                      // глубина кадра: 0 - верхний уровень
+    QueryStackFrameKind kind;       // вид кадра
+    char *trigger_name;             // имя триггера, если запрос пришёл из триггерной функции
+    Oid trigger_relid;              // таблица, на которой сработал триггер
+    bool in_scope;                  // кадр внутри функции из pg_query_stack.capture_functions (сам или кто-то выше)
+    bool captured;                  // кадр записан полностью; иначе это только отметка глубины (query_text = NULL)
+    struct QueryStackEntry *parent; // кадр, под которым добавлен этот (NULL - верхний уровень)
+    uint64 text_hash;               // хэш текста запроса
+    uint64 path_hash;               // хэш пути вызовов: хэш пути родителя + хэш текста
+    uint64 plan_hash;               // структурный хэш плана (считается только при pg_query_stack.track_profile)
+    uint64 query_id;                // queryId запроса кадра (0 - не вычислен)
+    instr_time start_time;          // момент добавления кадра (только при pg_query_stack.track_profile)
+    double child_time;              // время (мс) завершившихся дочерних кадров, для подсчёта собственного времени
+    uint64 rows;                    // es_processed на момент ExecutorEnd
+    JitInstrumentation jit;         // затраты JIT-компиляции запроса кадра (снимаются в ExecutorEnd, только при track_profile)
+    int repeat_count;               // только в копиях для вывода: сколько раз подряд повторился цикл кадров
+    bool traced;                    // добавление кадра записано в трассировку сессии (при снятии пишем и его конец)
+    bool first_exec;                // первое выполнение текста запроса в сессии (прогрев; только при track_profile)
+    struct QueryStackEntry *origin; // кадр, поставивший в очередь событие AFTER-триггера, из тела которого пришёл запрос (NULL - нет)
+    double plan_rows;               // оценка числа строк верхнего узла плана на момент ExecutorEnd (-1 - нет, только при track_profile)
+    bool run_limited;               // выполнение шло порциями (курсор, SELECT INTO): план мог быть выполнен не до конца
 } QueryStackEntry;
 
+/*
+    Вызов функции PL/pgSQL, отслеживаемый через интерфейс плагина PL/pgSQL (PLpgSQL_plugin).
+    Нужен для того, чтобы понять, что очередной запрос пришёл именно из тела функции (и из триггера ли она вызвана).
+    Запросы функции добавляются в стек на той глубине, которая была при входе в функцию (frame_depth).
+*/
+typedef struct QueryStackPLCall
+{
+    PLpgSQL_execstate *estate;      // состояние выполнения функции, по нему находим свою запись в func_end
+    int frame_depth;                // глубина стека при входе в функцию
+    SubTransactionId subid;         // подтранзакция, в которой начат вызов
+    char *trigger_name;             // имя триггера (NULL - функция вызвана не как триггер)
+    Oid trigger_relid;              // таблица триггера
+    bool matched;                   // функция подходит под правила pg_query_stack.capture_functions
+    uint64 override_mask;           // элементы путей pg_query_stack.overrides, под которые подходит функция
+    int guc_nestlevel;              // уровень GUC с применёнными переопределениями (0 - не применялись)
+    instr_time start_time;          // момент входа в функцию (только при pg_query_stack.track_profile)
+    bool first_call;                // первый вызов функции в сессии после её (пере)компиляции
+    PLpgSQL_stmt *dynamic_stmt;     // выполняемый оператор с динамическим SQL (его планирование учитываем отдельно), иначе NULL
+    QueryStackEntry *origin;        // для строчного AFTER-триггера: кадр изменяющего запроса, записавшего строку события
+} QueryStackPLCall;
+
+// Стек активных вызовов функций PL/pgSQL (самый вложенный первый), живёт в QueryStackContext
+static List *PL_Call_Stack = NIL;
+
+/*
+    Кадры изменяющих запросов транзакции по номеру команды (CommandId).
+    Событие AFTER-триггера хранит только ссылку на строку, а строка - номер записавшей её команды (cmin, для удаления - cmax).
+    Поэтому при срабатывании триггера (в том числе отложенного, на COMMIT) кадр-источник находится по строке события,
+    а постановка самих событий в очередь ничего не стоит: одна запись в таблицу на изменяющий запрос, а не на строку.
+    Кадры после снятия со стека остаются в QueryStackContext до конца транзакции, поэтому ссылки на них валидны.
+*/
+typedef struct QueryStackOriginEntry
+{
+    CommandId   cid;                // ключ
+    QueryStackEntry *frame;         // последний изменяющий запрос с этим номером команды
+} QueryStackOriginEntry;
+
+static HTAB *TriggerOrigins = NULL;     // живёт в QueryStackContext
+
 
 // Прототипы функций инициализации расширения и выгрузки
 void _PG_init(void);
@@ -41,8 +179,26 @@ void _PG_fini(void);
 
 // Прототипы хуков и обратных вызовов
 static void pg_query_stack_ExecutorStart(QueryDesc *queryDesc, int eflags);
+static void pg_query_stack_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
+                                       bool execute_once);
 static void pg_query_stack_ExecutorEnd(QueryDesc *queryDesc);
+static PlannedStmt *pg_query_stack_planner(Query *parse, const char *query_string, int cursorOptions,
+                                           ParamListInfo boundParams);
 static void pg_query_stack_xact_callback(XactEvent event, void *arg);
+static void pg_query_stack_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                                            SubTransactionId parentSubid, void *arg);
+static void pg_query_stack_plpgsql_func_setup(PLpgSQL_execstate *estate, PLpgSQL_function *func);
+static void pg_query_stack_plpgsql_func_beg(PLpgSQL_execstate *estate, PLpgSQL_function *func);
+static void pg_query_stack_plpgsql_func_end(PLpgSQL_execstate *estate, PLpgSQL_function *func);
+static void pg_query_stack_plpgsql_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt);
+
+// Прототипы функций, которые нужны при снятии кадра (pg_stack_free) раньше своего определения
+static void pg_query_stack_publish_pop(bool republish);
+static void pg_query_stack_trace_pop(QueryStackEntry *entry);
+static void pg_query_stack_report_query_id(void);
+static void pg_query_stack_service_requests(void);
+static void pg_query_stack_flush_windows(void);
+static void pg_query_stack_sample_sync(void);
 
 // Порождаемый контекст памяти от TopTransactionContext
 static MemoryContext QueryStackContext = NULL;
@@ -52,117 +208,582 @@ Datum pg_query_stack(PG_FUNCTION_ARGS);
 
 // Сюда сохраняем предыдущие хуки для их восстановления при выгрузке расширения
 static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+static ExecutorRun_hook_type prev_ExecutorRun = NULL;
 static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+static planner_hook_type prev_planner_hook = NULL;
 
+/*
+    Плагин PL/pgSQL. PL/pgSQL находит его через "rendezvous variable" PLpgSQL_plugin и вызывает
+    наши функции на входе/выходе из каждой функции. Плагин может быть только один, поэтому
+    если до нас уже был установлен другой (например, отладчик) - сохраняем его и вызываем по цепочке.
+*/
+static PLpgSQL_plugin pg_query_stack_plpgsql_plugin = {
+    pg_query_stack_plpgsql_func_setup,
+    pg_query_stack_plpgsql_func_beg,
+    pg_query_stack_plpgsql_func_end,
+    pg_query_stack_plpgsql_stmt_beg,
+};
+static PLpgSQL_plugin **plpgsql_plugin_ptr = NULL;
+static PLpgSQL_plugin *prev_plpgsql_plugin = NULL;
 
-// Собственная реализация функции переворота списка, так как внутренняя list_reverse не доступна для модулей
-static List *
-pg_list_reverse_copy(List *list)
+/*
+    Область полного захвата кадров.
+    pg_query_stack.capture_functions - список функций (имя или схема.имя), под которыми кадры пишутся полностью;
+    pg_query_stack.capture_max_depth - сколько верхних уровней стека пишется полностью всегда (0 - ограничения нет).
+    Если задано хоть одно из правил, кадры вне области пишутся как отметки глубины: без копирования текста запроса.
+*/
+static char *capture_functions_string = NULL;
+static int capture_max_depth = 0;
+
+/*
+    Разобранный список capture_functions. Разбираем один раз в check-хуке GUC и храним одним блоком памяти
+    (GUC сам освобождает "extra"), имена лежат в буфере names, правила ссылаются на них смещениями.
+*/
+typedef struct QueryStackScopeRule
 {
-    List       *reversed = NIL;
-    ListCell   *cell;
+    int schema_off;                 // смещение имени схемы в names (-1 - любая схема)
+    int name_off;                   // смещение имени функции в names
+} QueryStackScopeRule;
 
-    foreach(cell, list)
-    {
-        reversed = lcons(lfirst(cell), reversed);
-    }
+typedef struct QueryStackScopeRules
+{
+    int nrules;
+    QueryStackScopeRule rules[FLEXIBLE_ARRAY_MEMBER];
+    // за массивом правил следует буфер имён
+} QueryStackScopeRules;
 
-    return reversed;
-}
+#define ScopeRulesNames(r) ((char *) &(r)->rules[(r)->nrules])
 
+static QueryStackScopeRules *capture_scope_rules = NULL;
 
-// Удаление последней добавленной записи в стек освобождение памяти
-static void
-pg_stack_free(void)
+/*
+    Кэш результатов сопоставления функции с правилами: oid функции -> подходит ли.
+    Обращение к каталогу происходит один раз на функцию, кэш сбрасывается при смене правил или изменении pg_proc.
+*/
+typedef struct QueryStackScopeCacheEntry
 {
-    if (Query_Stack != NIL)
-    {
-        // Удаляем последний добавленный элемент
-        Query_Stack = list_delete_first(Query_Stack);
-        
-        // Освобождать память не нужно, все за нас сделает Postgres при очистке QueryStackContext
-    }
-}
+    Oid fn_oid;                     // ключ
+    bool matched;                   // подходит под capture_functions
+    uint64 override_mask;           // бит k - функция подходит под k-й элемент путей pg_query_stack.overrides
+} QueryStackScopeCacheEntry;
 
+static HTAB *ScopeFuncCache = NULL;
+static bool ScopeFuncCacheValid = false;
 
-// Загрузка расширения в память
-void
-_PG_init(void)
+/*
+    Переопределения параметров по путям вызовов (pg_query_stack.overrides):
+        'report_build: work_mem=512MB; billing.close_month > recalc_line: enable_nestloop=off, random_page_cost=1.1'
+    Правило - путь из функций PL/pgSQL (внешняя > ... > вложенная, промежуточные вызовы допускаются) и список параметров.
+    При входе в функцию, на которой заканчивается путь, параметры устанавливаются на своём уровне вложенности GUC
+    (как SET у функции) и действуют для всех её запросов и вложенных вызовов, при выходе из функции восстанавливаются.
+    Разбирается один раз в check-хуке одним блоком памяти, как и capture_functions.
+*/
+static char *overrides_string = NULL;
+
+// Сколько разных функций могут упоминаться в путях правил (по биту на элемент в override_mask)
+#define MAX_OVERRIDE_ELEMS 64
+
+typedef struct QueryStackOverrideSetting
 {
-    // Регистрируем хуки (сохраняя прошлые)
-    prev_ExecutorStart = ExecutorStart_hook;
-    ExecutorStart_hook = pg_query_stack_ExecutorStart;
-    prev_ExecutorEnd = ExecutorEnd_hook;
-    ExecutorEnd_hook = pg_query_stack_ExecutorEnd;
-    
-    // Регистрируем callback транзакции
-    RegisterXactCallback(pg_query_stack_xact_callback, NULL);
-}
+    int name_off;                   // смещение имени параметра в names
+    int value_off;                  // смещение значения в names
+} QueryStackOverrideSetting;
 
+typedef struct QueryStackOverrideRule
+{
+    int first_elem;                 // первый элемент пути в elems (элементы идут от внешней функции к вложенной)
+    int nelems;
+    int first_setting;              // первый параметр в settings
+    int nsettings;
+} QueryStackOverrideRule;
 
-// Выгрузка расширения из памяти
-void
-_PG_fini(void)
+typedef struct QueryStackOverrides
 {
-    // Восстанавливаем прошлые хуки
-    ExecutorStart_hook = prev_ExecutorStart;
-    ExecutorEnd_hook = prev_ExecutorEnd;
-    
-    // Снимаем регистрацию callback транзакции
-    UnregisterXactCallback(pg_query_stack_xact_callback, NULL);
-}
+    int nrules;
+    int nelems;
+    int nsettings;
+    QueryStackOverrideRule *rules;  // указатели внутрь этого же блока
+    QueryStackScopeRule *elems;
+    QueryStackOverrideSetting *settings;
+    char *names;
+} QueryStackOverrides;
 
-/* 
-    Функция обратного вызова транзакции
-    Зачем он нам нужен? 
-    Дело в том, что есть случаи когда у нас НЕ вызывается End хук и стек остается не очищенным.
-    Это такие случаи, когда например во вложенном вызове происходит ошибка на этапе разбора плана (не нашлась таблица, функция, колонка).
-    В этом случае происходит мгновенный выход из транзакции и не вызываются End хуки головного запроса и так далее по цепочке выше.
-    В этих случаях мы перехватываем callback транзакции и очищаем ВЕСЬ стек вручную. 
+static QueryStackOverrides *override_rules = NULL;
+
+/*
+    Показ в pg_stat_activity.query_id запроса самого вложенного кадра вместо запроса верхнего уровня.
+    Используется обычный механизм pgstat_report_query_id, никакой дополнительной общей памяти не нужно.
 */
-static void
-pg_query_stack_xact_callback(XactEvent event, void *arg)
+static bool report_query_id = false;
+
+/*
+    Профиль путей вызовов сессии.
+    Ключ - путь вызовов (хэш цепочки текстов от верхнего уровня до кадра) и структурный хэш плана кадра.
+    Так видно, когда на одном пути вызовов запрос выполняется разными планами и какой из них медленный.
+    Профиль живёт всю сессию (до pg_query_stack_profile_reset()), размер ограничен pg_query_stack.profile_max.
+*/
+static bool track_profile = false;
+static int profile_max = 5000;
+
+// Сколько байт текста запроса сохраняем в записи профиля
+#define PROFILE_TEXT_LEN 1024
+
+typedef struct QueryStackProfileKey
 {
-    if (event == XACT_EVENT_ABORT || event == XACT_EVENT_COMMIT)
-    {
-        if (QueryStackContext != NULL)
-        {
-            MemoryContextDelete(QueryStackContext);
-            QueryStackContext = NULL;
-        }
+    uint64 path_hash;
+    uint64 plan_hash;
+} QueryStackProfileKey;
 
-        Query_Stack = NIL;
-    }
-}
+/*
+    Гистограмма времени выполнения с логарифмическими корзинами (как в DDSketch): корзина i покрывает
+    (HIST_GAMMA^(i-1), HIST_GAMMA^i] микросекунд, то есть от 1 мкс до нескольких часов с относительной ошибкой ~5%.
+    Гистограммы складываются покорзинно, поэтому их можно объединять между сессиями в общем агрегате.
+*/
+#define HIST_BUCKETS 256
+#define HIST_GAMMA 1.1
+
+typedef struct QueryStackHistogram
+{
+    double max_time;                // максимальное время, мс (точное)
+    uint32 buckets[HIST_BUCKETS];
+} QueryStackHistogram;
+
+// Накопленные счётчики по пути вызовов
+typedef struct QueryStackCounters
+{
+    int64 calls;                    // количество выполнений
+    double total_time;              // общее время, мс
+    double self_time;               // время без вложенных кадров, мс
+    int64 rows;                     // обработано строк (es_processed)
+    int64 jit_functions;            // скомпилировано функций JIT
+    double jit_generation_time;     // время JIT: генерация кода, мс
+    double jit_inlining_time;       // время JIT: встраивание, мс
+    double jit_optimization_time;   // время JIT: оптимизация, мс
+    double jit_emission_time;       // время JIT: выпуск машинного кода, мс
+    int64 warmup_calls;             // из calls: первые выполнения текста запроса в сессии
+    double warmup_time;             // из total_time: время первых выполнений, мс
+    int64 est_calls;                // выполнения, у которых оценка числа строк сравнивалась с фактом
+    double est_rows;                // сумма оценок числа строк верхнего узла плана по этим выполнениям
+    double est_actual_rows;         // сумма фактического числа строк по этим выполнениям
+    double est_log_ratio;           // сумма ln(факт / оценка): по ней направление ошибки оценки
+    double est_abs_log_ratio;       // сумма |ln(факт / оценка)|: по ней типичная ошибка (ошибки в разные стороны не гасятся)
+    QueryStackHistogram histogram;  // распределение времени выполнения (для процентилей)
+} QueryStackCounters;
+
+typedef struct QueryStackProfileEntry
+{
+    QueryStackProfileKey key;       // ключ (должен быть первым)
+    uint64 parent_path_hash;        // путь родительского кадра (0 - верхний уровень)
+    int depth;                      // глубина кадра
+    QueryStackFrameKind kind;       // вид кадра при первом выполнении
+    char *query_text;               // начало текста запроса (NULL для отметок глубины)
+    QueryStackCounters counters;
+} QueryStackProfileEntry;
 
+static HTAB *ProfileHash = NULL;
 
 /*
-Выполняем перехват запроса нашим хуком и записываем его в стек (список Query_Stack). 
-Почему именно ExecutorStart:
-    ExecutorStart: Вызывается в самом начале выполнения плана запроса, перед тем как будут обработаны какие-либо данные. 
-                   Он позволяет выполнить инициализацию или модификации перед началом фактического исполнения запроса, или запись в стек в нашем случае
-    ExecutorRun: Вызывается при фактическом выполнении плана, когда началось извлечение кортежей (строк данных). 
-                 Он может вызываться несколько раз в течение одного запроса, особенно если запрос выполняется в пакетном режиме или использует курсоры.
-             
-Именно поэтому нам подходит хук ExecutorStart.
+    Стоимость прогрева сессии: первый вызов функции PL/pgSQL платит за её компиляцию, построение планов
+    и загрузку кэшей каталога, первое выполнение текста запроса - за построение его плана.
+    Тексты, уже выполнявшиеся в сессии, хранятся множеством хэшей (WarmupTextHash),
+    функции - в FuncProfileHash вместе с версией строки pg_proc (при её смене функция компилируется заново).
+    Обе таблицы живут в ProfileContext и сбрасываются вместе с профилем.
 */
-static void
-pg_query_stack_ExecutorStart(QueryDesc *queryDesc, int eflags)
+static HTAB *WarmupTextHash = NULL;
+
+typedef struct QueryStackFuncProfileEntry
 {
-    MemoryContext oldcontext;
+    Oid fn_oid;                     // ключ
+    TransactionId fn_xmin;          // версия строки pg_proc, для которой функция скомпилирована
+    ItemPointerData fn_tid;
+    int64 compiles;                 // сколько раз функция компилировалась в сессии
+    int64 warmup_calls;             // завершившиеся первые вызовы после компиляции
+    double warmup_time;             // время первых вызовов после компиляции, мс
+    int64 calls;                    // все вызовы, включая первые
+    double total_time;              // время всех вызовов, мс
+} QueryStackFuncProfileEntry;
+
+static HTAB *FuncProfileHash = NULL;
+
+/*
+    Повторное планирование динамического SQL (EXECUTE, FOR ... EXECUTE, OPEN ... EXECUTE, RETURN QUERY EXECUTE в PL/pgSQL).
+    Такой запрос планируется заново при каждом выполнении, а в профиле путей вызовов теряется: тексты с разными литералами дают разные пути.
+    Поэтому время планирования (хук планировщика) копим отдельно по вызывающему пути, функции и нормализованному запросу -
+    его queryId или, если queryId не вычисляется, хэшу текста без литералов. Таблица живёт в ProfileContext и сбрасывается вместе с профилем.
+*/
+typedef struct QueryStackDynamicPlanKey
+{
+    uint64 caller_path_hash;        // путь вызовов кадра, выполняющего функцию (0 - функция вызвана вне запроса)
+    uint64 query_hash;              // queryId или хэш нормализованного текста
+    Oid fn_oid;                     // функция, выполнившая динамический запрос
+} QueryStackDynamicPlanKey;
+
+typedef struct QueryStackDynamicPlanEntry
+{
+    QueryStackDynamicPlanKey key;   // ключ (должен быть первым)
+    char *caller_stack;             // стек вызывающего кадра (NULL - вне запроса)
+    char *query_text;               // начало текста первого из запросов
+    int64 plans;                    // сколько раз запрос планировался
+    double plan_time;               // суммарное время планирования, мс
+} QueryStackDynamicPlanEntry;
+
+static HTAB *DynamicPlanHash = NULL;
+static MemoryContext ProfileContext = NULL;
+
+// Количество разных планов на пути вызовов (для колонки path_plans)
+typedef struct QueryStackPathPlans
+{
+    uint64 path_hash;               // ключ
+    int nplans;
+} QueryStackPathPlans;
+
+// Запись профиля по пути вызовов (для восстановления стека вызывающих кадров в отчётах)
+typedef struct QueryStackPathEntry
+{
+    uint64 path_hash;               // ключ
+    QueryStackProfileEntry *entry;  // первая попавшаяся запись профиля с этим путём (любой план)
+} QueryStackPathEntry;
+
+/*
+    Общая память (только при загрузке через shared_preload_libraries).
+    Каждый backend публикует в своём слоте верхние publish_depth кадров своего стека: хэш пути вызовов,
+    хэш текста и время старта кадра. По опубликованным кадрам другие сессии видят, что выполняется во всём кластере.
+    При загрузке только через session_preload_libraries общей памяти нет и функции, которым она нужна, выдают ошибку.
+
+    Запись в слот ведёт только его владелец, читатели используют протокол счётчика изменений,
+    как pg_stat_activity (st_changecount): нечётное значение - идёт запись, при несовпадении до/после - читаем заново.
+*/
+// Сколько байт текстового представления стека вызовов храним в общих агрегатах
+#define STACK_TEXT_LEN 512
+// Сколько символов текста каждого кадра попадает в текстовое представление стека
+#define STACK_FRAME_TEXT_LEN 64
+
+typedef struct QueryStackSharedFrame
+{
+    uint64 path_hash;               // хэш пути вызовов кадра
+    uint64 text_hash;               // хэш текста запроса кадра
+    TimestampTz start_time;         // время старта кадра
+} QueryStackSharedFrame;
+
+typedef struct QueryStackBackendSlot
+{
+    int changecount;                // счётчик изменений (нечётный - идёт запись)
+    int pid;                        // процесс-владелец (0 - слот свободен)
+    Oid dbid;                       // база данных backend-а
+    Oid userid;                     // пользователь сессии: чужие стеки видны только с его правами или с pg_read_all_stats
+    int depth;                      // количество опубликованных кадров
+    pg_atomic_uint64 explain_request;   // запрос плана от другого backend-а: pid запросившего << 32 | код кадра (0 - нет)
+    TransactionId xid;              // xid транзакции и кадр, в котором он был присвоен (InvalidTransactionId - нет)
+    TimestampTz xid_time;
+    char xid_stack[STACK_TEXT_LEN];
+    TransactionId xmin;             // xmin backend-а и кадр, взявший удерживающий его снимок (InvalidTransactionId - нет)
+    TimestampTz xmin_time;
+    char xmin_stack[STACK_TEXT_LEN];
+    QueryStackSharedFrame frames[FLEXIBLE_ARRAY_MEMBER];
+} QueryStackBackendSlot;
+
+// Код кадра в explain_request: номер кадра + 1 или EXPLAIN_INNERMOST_FRAME для самого вложенного
+#define EXPLAIN_INNERMOST_FRAME PG_UINT32_MAX
+
+typedef struct QueryStackSharedState
+{
+    LWLock *lock;                   // защищает состав общих хэш-таблиц: shared - поиск и чтение, exclusive - добавление и удаление записей
+                                    // (счётчики записей защищены их спин-блокировками, слоты backend-ов блокировкой не защищаются)
+    int nslots;                     // количество слотов (MaxBackends)
+    int publish_depth;              // сколько кадров помещается в слот
+    Size slot_size;                 // размер одного слота
+    pg_atomic_uint64 profile_dropped;   // кадры, не поместившиеся в общий профиль (новые пути при заполненной таблице)
+    char slots[FLEXIBLE_ARRAY_MEMBER];
+} QueryStackSharedState;
+
+static QueryStackSharedState *SharedState = NULL;
+static QueryStackBackendSlot *MySlot = NULL;
+
+/*
+    Обратный индекс "кто пишет в таблицу": общий агрегат по ключу (база, таблица, операция, путь вызовов).
+    Наполняется в ExecutorEnd по результирующим таблицам запроса. Чтобы не брать общую блокировку на каждый запрос,
+    данные копятся в локальной таблице транзакции (PendingWrites) и сбрасываются в общую одним заходом при COMMIT.
+*/
+static bool track_writes = true;
+static int writers_max = 10000;
+
+/*
+    Кто держит горизонт очистки: для xid транзакции и для xmin backend-а (самого старого удерживаемого снимка)
+    в слоте публикуется стек кадра, в котором они появились. Проверка - сравнение двух чисел при добавлении и снятии кадра,
+    стек форматируется только когда xid или xmin изменились. Устаревшие значения отсекает представление
+    pg_query_stack_horizon: стек показывается, только пока xid и xmin совпадают с текущими из pg_stat_activity.
+*/
+static bool track_horizon = true;
+
+/*
+    Опрос запроса плана внутри узлов плана: ExecProcNode каждого узла кадра подменяется обёрткой, которая
+    перед вызовом узла читает explain_request. Без этого долгий узел без вложенных кадров ответит только по завершении запроса.
+    Стоимость - лишний косвенный вызов и чтение атомарной переменной на каждую строку каждого узла, а план строится
+    посреди работы узла во внутренней подтранзакции, поэтому по умолчанию выключено: запросы обслуживаются только
+    при добавлении и снятии кадров и в начале операторов PL/pgSQL.
+*/
+static bool explain_node_poll = false;
+
+typedef struct QueryStackWriteKey
+{
+    uint64 path_hash;               // путь вызовов пишущего запроса
+    Oid dbid;                       // база данных
+    Oid relid;                      // таблица (для секций и наследников - корневая)
+    int32 operation;                // CmdType запроса
+} QueryStackWriteKey;
+
+typedef struct QueryStackWriteCounters
+{
+    int64 calls;                    // количество запросов
+    int64 rows;                     // обработано строк
+    double total_time;              // время выполнения запросов, мс
+} QueryStackWriteCounters;
+
+/*
+    Ключ локальной таблицы: записи отдельно по подтранзакциям, чтобы при откате подтранзакции (блок EXCEPTION,
+    ROLLBACK TO SAVEPOINT) выбросить её записи - изменения откачены и в индекс попасть не должны.
+    Вложенные подтранзакции получают большие номера, поэтому при откате удаляются записи с subid не меньше откатываемого.
+*/
+typedef struct QueryStackPendingWriteKey
+{
+    QueryStackWriteKey key;
+    SubTransactionId subid;         // подтранзакция, в которой выполнен запрос
+} QueryStackPendingWriteKey;
+
+// Запись локальной таблицы транзакции
+typedef struct QueryStackPendingWrite
+{
+    QueryStackPendingWriteKey key;  // ключ (должен быть первым)
+    QueryStackWriteCounters counters;
+    char *stack_text;               // цепочка вызовов (строится один раз на ключ за подтранзакцию)
+    bool flushed;                   // уже добавлена в существующую запись общей таблицы
+} QueryStackPendingWrite;
+
+// Запись общей таблицы
+typedef struct QueryStackSharedWrite
+{
+    QueryStackWriteKey key;         // ключ (должен быть первым)
+    slock_t mutex;                  // защищает counters
+    QueryStackWriteCounters counters;
+    char stack_text[STACK_TEXT_LEN];
+} QueryStackSharedWrite;
+
+static HTAB *PendingWrites = NULL;      // живёт в QueryStackContext
+static HTAB *SharedWritesHash = NULL;
+
+/*
+    Общий профиль путей вызовов: профили сессий с включённым track_profile, объединённые по всему кластеру.
+    Как и обратный индекс записей, копится в таблице транзакции (PendingProfile) и сбрасывается в общую
+    одним заходом при завершении транзакции (и при откате: время всё равно потрачено).
+*/
+static int shared_profile_max = 5000;
+
+typedef struct QueryStackSharedProfileKey
+{
+    uint64 path_hash;
+    uint64 plan_hash;
+    Oid dbid;
+} QueryStackSharedProfileKey;
+
+// Запись локальной таблицы транзакции
+typedef struct QueryStackPendingProfile
+{
+    QueryStackSharedProfileKey key; // ключ (должен быть первым)
+    uint64 parent_path_hash;
+    int depth;
+    QueryStackFrameKind kind;
+    char *query_text;               // начало текста запроса (NULL для отметок глубины)
+    QueryStackCounters counters;
+    bool flushed;                   // уже добавлена в существующую запись общего профиля
+} QueryStackPendingProfile;
+
+// Запись общей таблицы
+typedef struct QueryStackSharedProfileEntry
+{
+    QueryStackSharedProfileKey key; // ключ (должен быть первым)
+    uint64 parent_path_hash;
+    int depth;
+    QueryStackFrameKind kind;
+    slock_t mutex;                  // защищает counters
+    QueryStackCounters counters;
+    char query_text[PROFILE_TEXT_LEN];  // пустая строка для отметок глубины
+} QueryStackSharedProfileEntry;
+
+static HTAB *PendingProfile = NULL;     // живёт в QueryStackContext
+static HTAB *SharedProfileHash = NULL;
+
+/*
+    Профиль по окнам времени: кольцо из window_count окон по window_seconds секунд в общей памяти.
+    Окно с номером эпохи e (e = время / window_seconds) лежит в ячейке кольца e % window_count.
+    Смена окна - O(1): записываем в окно новый номер эпохи, а записи с другим номером эпохи считаются пустыми
+    (таблица окна с открытой адресацией, записи только добавляются, поэтому цепочки проб не рвутся).
+    У каждого окна своя блокировка, общая блокировка расширения не используется. Наполняется при сбросе профиля транзакции.
+*/
+static int window_count = 60;
+static int window_seconds = 60;
+static int window_entries = 1000;
+
+typedef struct QueryStackWindowEntry
+{
+    int64 epoch;                    // эпоха, к которой относится запись (не равна эпохе окна - запись пуста)
+    QueryStackSharedProfileKey key;
+    int64 calls;
+    double total_time;
+    double self_time;
+    int64 rows;
+} QueryStackWindowEntry;
+
+typedef struct QueryStackWindow
+{
+    LWLock *lock;                   // блокировка этого окна
+    int64 epoch;                    // эпоха окна (0 - окно не использовалось)
+    int64 dropped;                  // кадры, не поместившиеся в таблицу окна
+    QueryStackWindowEntry entries[FLEXIBLE_ARRAY_MEMBER];
+} QueryStackWindow;
+
+static char *SharedWindows = NULL;
+
+#define WindowSize() \
+    MAXALIGN(add_size(offsetof(QueryStackWindow, entries), mul_size(window_entries, sizeof(QueryStackWindowEntry))))
+#define SharedWindow(i) ((QueryStackWindow *) (SharedWindows + (Size) (i) * WindowSize()))
+
+// Сколько верхних кадров стека каждый backend публикует в общей памяти
+static int publish_depth = 16;
+
+/*
+    Трассировка сессии (pg_query_stack_trace_start / pg_query_stack_trace_stop).
+    Каждое добавление и снятие кадра записывается в заранее выделенный буфер событий фиксированного размера:
+    запись события - это копирование не более TRACE_TEXT_LEN байт текста и нескольких полей, без выделения памяти.
+    Буфер живёт в TraceContext (от TopMemoryContext), поэтому трассировка переживает границы транзакций.
+*/
+#define TRACE_TEXT_LEN 64
+
+typedef struct QueryStackTraceEvent
+{
+    instr_time time;                // момент события
+    uint64 text_hash;               // хэш текста кадра
+    uint64 rows;                    // для конца кадра: обработано строк
+    int32 depth;                    // глубина кадра
+    char phase;                     // 'B' - добавление кадра, 'E' - снятие
+    uint8 kind;                     // вид кадра
+    bool has_text;                  // текст кадра был сохранён (кадр не отметка глубины)
+    char text[TRACE_TEXT_LEN];      // начало текста запроса (может обрываться посреди многобайтового символа)
+} QueryStackTraceEvent;
+
+static MemoryContext TraceContext = NULL;
+static QueryStackTraceEvent *TraceEvents = NULL;
+static bool TraceActive = false;    // идёт запись; буфер может оставаться и после остановки, пока его не прочитали
+static int TraceMaxEvents = 0;
+static int TraceNEvents = 0;
+static int TraceOpen = 0;           // записанные, но ещё не снятые кадры (под их концы держим место в буфере)
+static int64 TraceDropped = 0;      // кадры, не попавшие в трассировку из-за заполнения буфера
+static instr_time TraceStartTime;
+
+// Сколько байт JSON копим перед записью в файл
+#define TRACE_WRITE_CHUNK 65536
+
+/*
+    Сэмплирующий профилировщик сессии (pg_query_stack_sample_start): по таймеру (timeout.h) обработчик сигнала
+    записывает путь вызовов верхнего кадра в заранее выделенную таблицу с открытой адресацией.
+    Обработчик только читает и пишет уже выделенную память, поэтому безопасен в контексте сигнала.
+    Общая память не нужна, так что профилировщик работает и при загрузке через session_preload_libraries.
+    Тексты путей для отчёта собираются вне обработчика - при добавлении кадра, пока идёт сэмплирование.
+*/
+typedef struct QueryStackSampleSlot
+{
+    uint64 path_hash;               // 0 - слот свободен
+    uint64 samples;
+} QueryStackSampleSlot;
+
+typedef struct QueryStackSamplePath
+{
+    uint64 path_hash;               // ключ
+    char *stack;                    // свёрнутый стек: подписи кадров от верхнего уровня через ';'
+} QueryStackSamplePath;
+
+static MemoryContext SampleContext = NULL;
+static volatile QueryStackSampleSlot *SampleSlots = NULL;
+static uint32 SampleSize = 0;               // размер таблицы: степень двойки, не меньше 2 * SampleMaxPaths
+static uint32 SampleMaxPaths = 0;
+static volatile uint32 SampleUsed = 0;      // занятые слоты
+static volatile uint64 SampleTotal = 0;     // срабатывания таймера (в том числе при пустом стеке)
+static volatile uint64 SampleDropped = 0;   // сэмплы новых путей, не поместившихся в таблицу
+static volatile uint64 SampleCurrentPath = 0;   // путь вызовов верхнего кадра (0 - стек пуст), его читает обработчик
+static HTAB *SamplePaths = NULL;            // тексты путей, живёт в SampleContext
+static bool SampleActive = false;
+static int SampleInterval = 0;              // период таймера, мс
+static TimeoutId SampleTimeoutId = MAX_TIMEOUTS;    // MAX_TIMEOUTS - таймер ещё не зарегистрирован
+
+/*
+    Сбор вложенных запросов для pg_query_stack_explain_nested(): пока выполняется EXPLAIN ANALYZE,
+    кадры глубже объясняемого запроса агрегируются по пути вызовов, чтобы показать их деревом под планом.
+*/
+typedef struct QueryStackNestedEntry
+{
+    uint64 path_hash;               // ключ
+    uint64 parent_path_hash;
+    int seq;                        // порядок первого появления (для вывода детей в порядке выполнения)
+    char *query_text;
+    int64 calls;
+    double total_time;
+    int64 rows;
+} QueryStackNestedEntry;
+
+static HTAB *NestedProfile = NULL;      // не NULL - идёт сбор
+static MemoryContext NestedContext = NULL;  // контекст, в котором живёт NestedProfile (для копий текстов)
+static int NestedBaseDepth = 0;         // глубина, на которой выполняется объясняемый запрос
+static uint64 NestedRootPath = 0;       // путь вызовов объясняемого запроса
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+#define SharedSlot(state, i) \
+    ((QueryStackBackendSlot *) ((state)->slots + (Size) (i) * (state)->slot_size))
+
+// Протокол записи в свой слот (см. PGSTAT_BEGIN_WRITE_ACTIVITY)
+#define SLOT_BEGIN_WRITE(slot) \
+    do { \
+        START_CRIT_SECTION(); \
+        (slot)->changecount++; \
+        pg_write_barrier(); \
+    } while (0)
+
+#define SLOT_END_WRITE(slot) \
+    do { \
+        pg_write_barrier(); \
+        (slot)->changecount++; \
+        Assert(((slot)->changecount & 1) == 0); \
+        END_CRIT_SECTION(); \
+    } while (0)
+
+// Включено ли хоть одно правило области захвата
+#define CaptureFiltersActive() \
+    ((capture_scope_rules != NULL && capture_scope_rules->nrules > 0) || capture_max_depth > 0)
 
-    // Если по какой-то причине нам не доступен контекст транзакции - просто выходим
-    if (TopTransactionContext == NULL)
+
+// Собственная реализация функции переворота списка, так как внутренняя list_reverse не доступна для модулей
+static List *
+pg_list_reverse_copy(List *list)
+{
+    List       *reversed = NIL;
+    ListCell   *cell;
+
+    foreach(cell, list)
     {
-        if (prev_ExecutorStart)
-            prev_ExecutorStart(queryDesc, eflags);
-        else
-            standard_ExecutorStart(queryDesc, eflags);
-            
-        return;
+        reversed = lcons(lfirst(cell), reversed);
     }
-    
-    // Порождаем свой контекст от TopTransactionContext
+
+    return reversed;
+}
+
+
+/*
+    Порождаем (при необходимости) свой контекст памяти от TopTransactionContext.
+    В нём живут кадры стека и записи о вызовах PL/pgSQL, он удаляется целиком при завершении транзакции.
+*/
+static MemoryContext
+pg_query_stack_get_context(void)
+{
     if (QueryStackContext == NULL)
     {
         /*
@@ -177,285 +798,4826 @@ pg_query_stack_ExecutorStart(QueryDesc *queryDesc, int eflags)
                                                   "QueryStackContext",
                                                   ALLOCSET_DEFAULT_SIZES);
     }
-    
-    // Перелючаем на собственный контекст
-    oldcontext = MemoryContextSwitchTo(QueryStackContext);
-    
-    // Создаём новый элемент стека
-    QueryStackEntry *entry = (QueryStackEntry *) palloc(sizeof(QueryStackEntry));
 
-    // Копируем sourceText
-    if (queryDesc->sourceText)
-        entry->query_text = pstrdup(queryDesc->sourceText);
-    else
-        entry->query_text = pstrdup("<unnamed query>");
+    return QueryStackContext;
+}
 
-    // Добавляем запись в наш стек
-    Query_Stack = lcons(entry, Query_Stack);
-    
-    // Возвращаемся к предыдущему контексту
-    MemoryContextSwitchTo(oldcontext);
 
-    PG_TRY();
+/*
+    Удаление записи запроса из стека.
+    Ищем кадр именно этого QueryDesc: почти всегда это первый (последний добавленный) элемент,
+    но курсор может быть закрыт не в том порядке, в котором открывался, и тогда слепое удаление первого элемента сломало бы стек.
+*/
+static QueryStackEntry *
+pg_stack_free(QueryDesc *queryDesc)
+{
+    ListCell   *lc;
+
+    foreach(lc, Query_Stack)
     {
-        // Далее вызываем следующий хук или стандартную функцию
-        if (prev_ExecutorStart)
-            prev_ExecutorStart(queryDesc, eflags);
-        else
-            standard_ExecutorStart(queryDesc, eflags);
+        QueryStackEntry *entry = (QueryStackEntry *) lfirst(lc);
+
+        if (entry->query_desc == queryDesc)
+        {
+            bool        is_top = (foreach_current_index(lc) == 0);
+
+            Query_Stack = foreach_delete_current(Query_Stack, lc);
+            Query_Stack_Depth--;
+            pg_query_stack_publish_pop(!is_top);
+            pg_query_stack_trace_pop(entry);
+            pg_query_stack_report_query_id();
+            pg_query_stack_sample_sync();
+
+            // Освобождать память не нужно, все за нас сделает Postgres при очистке QueryStackContext.
+            // Возвращаем снятый кадр - до конца транзакции он остаётся валидным
+            return entry;
+        }
     }
-    PG_CATCH();
+
+    return NULL;
+}
+
+
+// Поиск кадра по QueryDesc (почти всегда это первый элемент стека)
+static QueryStackEntry *
+pg_query_stack_find_frame(QueryDesc *queryDesc)
+{
+    ListCell   *lc;
+
+    foreach(lc, Query_Stack)
     {
-        // Убираем текущий Query_Desc из списка при ошибке и освобождаем память
-        pg_stack_free();
-        
-        // Заново прокидываем ошибку
-        PG_RE_THROW();
+        QueryStackEntry *entry = (QueryStackEntry *) lfirst(lc);
+
+        if (entry->query_desc == queryDesc)
+            return entry;
     }
-    PG_END_TRY();
+
+    return NULL;
 }
 
-/* 
-    Хук ExecutorEnd. Убираем из стека последний запрос 
+
+/*
+    Определяем вид кадра при его добавлении. Порядок проверок важен:
+    - курсор: запрос стартует в ещё не запущенном портале курсора. Видимость портала не годится - порталы Bind
+      расширенного протокола тоже видимы, - поэтому курсор узнаём по CURSOR_OPT_FAST_PLAN: его ставят DECLARE
+      и OPEN курсора PL/pgSQL, а порталы протокола и неявные курсоры циклов FOR получают параметры по умолчанию;
+    - триггер: запрос пришёл из тела триггерной функции PL/pgSQL (в том числе отложенный триггер на COMMIT, глубина 0);
+    - верхний уровень: стек пуст;
+    - SPI: запрос из тела функции PL/pgSQL или через SPI из другого PL;
+    - SQL-функция: только запрос, отдающий результат SQL-функции через DestSQLFunction. DestNone используют и промежуточные
+      запросы SQL-функций, и EXPLAIN ANALYZE, и дополнительные действия правил, отличить их нельзя - это вложенные кадры.
 */
-static void
-pg_query_stack_ExecutorEnd(QueryDesc *queryDesc)
+static QueryStackFrameKind
+pg_query_stack_classify(QueryDesc *queryDesc, QueryStackPLCall *pl_call)
 {
-    PG_TRY();
+    CommandDest dest = queryDesc->dest ? queryDesc->dest->mydest : DestNone;
+
+    if (ActivePortal != NULL && ActivePortal->status == PORTAL_DEFINED &&
+        (ActivePortal->cursorOptions & CURSOR_OPT_FAST_PLAN) != 0)
+        return QSK_CURSOR;
+
+    if (pl_call != NULL && pl_call->trigger_name != NULL)
+        return QSK_TRIGGER;
+
+    if (Query_Stack_Depth == 0)
+        return QSK_TOPLEVEL;
+
+    if (pl_call != NULL || dest == DestSPI)
+        return QSK_SPI;
+
+    if (dest == DestSQLFunction)
+        return QSK_SQL_FUNCTION;
+
+    return QSK_NESTED;
+}
+
+
+// check-хук pg_query_stack.capture_functions: разбираем список один раз и отдаём результат в assign-хук через extra
+static bool
+pg_query_stack_capture_functions_check(char **newval, void **extra, GucSource source)
+{
+    char       *rawstring;
+    List       *elemlist;
+    ListCell   *lc;
+    Size        names_size = 0;
+    QueryStackScopeRules *rules;
+    char       *names;
+    int         i = 0;
+    int         off = 0;
+
+    rawstring = pstrdup(*newval);
+
+    if (!SplitIdentifierString(rawstring, ',', &elemlist))
     {
-        // Сначала вызываем предыдущие хуки 
-        if (prev_ExecutorEnd)
-            prev_ExecutorEnd(queryDesc);
+        GUC_check_errdetail("List syntax is invalid.");
+        pfree(rawstring);
+        list_free(elemlist);
+        return false;
+    }
+
+    foreach(lc, elemlist)
+        names_size += strlen((char *) lfirst(lc)) + 1;
+
+    rules = (QueryStackScopeRules *) guc_malloc(LOG, offsetof(QueryStackScopeRules, rules) +
+                                                list_length(elemlist) * sizeof(QueryStackScopeRule) +
+                                                names_size);
+    if (rules == NULL)
+    {
+        pfree(rawstring);
+        list_free(elemlist);
+        return false;
+    }
+
+    rules->nrules = list_length(elemlist);
+    names = ScopeRulesNames(rules);
+
+    foreach(lc, elemlist)
+    {
+        char       *elem = (char *) lfirst(lc);
+        char       *dot = strrchr(elem, '.');
+        Size        len = strlen(elem);
+
+        memcpy(names + off, elem, len + 1);
+
+        // "схема.имя": разрезаем строку на месте по последней точке
+        if (dot != NULL)
+        {
+            names[off + (dot - elem)] = '\0';
+            rules->rules[i].schema_off = off;
+            rules->rules[i].name_off = off + (dot - elem) + 1;
+        }
         else
-            standard_ExecutorEnd(queryDesc);
+        {
+            rules->rules[i].schema_off = -1;
+            rules->rules[i].name_off = off;
+        }
+
+        off += len + 1;
+        i++;
     }
-    PG_CATCH();
+
+    pfree(rawstring);
+    list_free(elemlist);
+
+    *extra = rules;
+    return true;
+}
+
+
+static void
+pg_query_stack_capture_functions_assign(const char *newval, void *extra)
+{
+    capture_scope_rules = (QueryStackScopeRules *) extra;
+    ScopeFuncCacheValid = false;
+}
+
+
+// Освобождение промежуточных списков разбора pg_query_stack.overrides (строки в них указывают в rawstring)
+static void
+pg_query_stack_overrides_free(char *rawstring, List *rule_paths, List *rule_settings)
+{
+    ListCell   *lc;
+    ListCell   *lc2;
+
+    foreach(lc, rule_paths)
+        list_free((List *) lfirst(lc));
+
+    foreach(lc, rule_settings)
     {
-        // Убираем текущий Query_Desc из списка при ошибке и освобождаем память
-        pg_stack_free();
-    
-        // Заново прокидываем ошибку
-        PG_RE_THROW();
+        foreach(lc2, (List *) lfirst(lc))
+            list_free((List *) lfirst(lc2));
+        list_free((List *) lfirst(lc));
     }
-    PG_END_TRY();
-        
-    // Убираем текущий Query_Desc из списка при ошибке и освобождаем память
-    pg_stack_free();
+
+    list_free(rule_paths);
+    list_free(rule_settings);
+    pfree(rawstring);
 }
 
+
 /*
-Это макрос из PostgreSQL, который объявляет информацию о функции для динамического загрузчика PostgreSQL.
-Назначение: Сообщает PostgreSQL, что функция pg_query_stack использует версию API V1 и может быть вызвана из SQL.
-Итоговый смысл:
-    - Без этого объявления PostgreSQL не сможет правильно сопоставить SQL-функцию с C-функцией в динамической библиотеке
-    - Обязательно для всех C-функций, экспортируемых в PostgreSQL
+    Разбор pg_query_stack.overrides: правила через ';', в правиле путь и параметры через ':',
+    функции пути через '>', параметры через ','. Значения параметров не могут содержать ',' и ';'.
 */
-PG_FUNCTION_INFO_V1(pg_query_stack);
-Datum // Datum — универсальный тип данных в PostgreSQL для хранения любых значений
-pg_query_stack(PG_FUNCTION_ARGS) // PG_FUNCTION_ARGS — макрос, который представляет стандартный набор аргументов, передаваемых в функции PostgreSQL на языке C
+static bool
+pg_query_stack_overrides_check(char **newval, void **extra, GucSource source)
 {
-    // Контекст вызова функции, используется для хранения информации между вызовами
-    FuncCallContext *funcctx;
-    // Получаем параметр _skip_count: это количество запросов в стеке, которые нам необходимо пропустить при возвращении результата
-    int              skip_count = PG_ARGISNULL(0) ? 0 : PG_GETARG_INT32(0);
-
-    if (skip_count < 0)
-        skip_count = 0;
+    char       *rawstring = pstrdup(*newval);
+    char       *rule_str;
+    char       *rule_save;
+    List       *rule_paths = NIL;       // списки имён функций пути
+    List       *rule_settings = NIL;    // списки пар имя, значение
+    ListCell   *lc;
+    ListCell   *lc2;
+    int         nelems = 0;
+    int         nsettings = 0;
+    Size        names_size = 0;
+    Size        size;
+    QueryStackOverrides *result;
+    int         ri = 0;
+    int         ei = 0;
+    int         si = 0;
+    int         off = 0;
 
-    /* 
-        Проверяем, является ли текущий вызов первым в серии вызовов SRF (set-returning function, SRF). 
-        Необходимо для инициализации переменных и настройки перед первым возвращением данных.
-    */
-    if (SRF_IS_FIRSTCALL())
+    for (rule_str = strtok_r(rawstring, ";", &rule_save); rule_str != NULL; rule_str = strtok_r(NULL, ";", &rule_save))
     {
-        MemoryContext     oldcontext;
-        List             *stack_copy;
-        int               depth = 0;
-        
-        // Инициализируем FuncCallContext для хранения состояния между вызовами
-        funcctx = SRF_FIRSTCALL_INIT();
+        char       *colon;
+        char       *setting_str;
+        char       *setting_save;
+        List       *path;
+        List       *settings = NIL;
 
-        /* 
-            Переключаем контекст памяти на multi_call_memory_ctx, который живет дольше, чем текущий вызов функции.
-            Позволяет сохранять данные между вызовами функции.
-            В oldcontext сохраняется предыдущий контекст.
-            
-            Все операции по копированию и созданию списков выполняются в контексте multi_call_memory_ctx
-            , который освобождается автоматически после завершения функции. Поэтому утечки тут невозможны.
-        */
-        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        // Пустые правила (например, после завершающей ';') пропускаем
+        while (isspace((unsigned char) *rule_str))
+            rule_str++;
+        if (*rule_str == '\0')
+            continue;
 
-        /* 
-            Копируем текущий стек запросов, чтобы он точно не изменился во время исполнения функции 
-        */
-        if (Query_Stack != NIL)
+        colon = strchr(rule_str, ':');
+        if (colon == NULL)
         {
-            stack_copy = NIL;
-            ListCell   *lc;
-            
-            foreach(lc, Query_Stack)
+            GUC_check_errdetail("Rule \"%s\" has no \":\" between the call path and the settings.", rule_str);
+            pg_query_stack_overrides_free(rawstring, rule_paths, rule_settings);
+            return false;
+        }
+        *colon = '\0';
+
+        if (!SplitIdentifierString(rule_str, '>', &path) || path == NIL)
+        {
+            GUC_check_errdetail("Call path \"%s\" is invalid.", rule_str);
+            list_free(path);
+            pg_query_stack_overrides_free(rawstring, rule_paths, rule_settings);
+            return false;
+        }
+        rule_paths = lappend(rule_paths, path);
+
+        for (setting_str = strtok_r(colon + 1, ",", &setting_save); setting_str != NULL;
+             setting_str = strtok_r(NULL, ",", &setting_save))
+        {
+            char       *eq = strchr(setting_str, '=');
+            char       *name = setting_str;
+            char       *value;
+            char       *end;
+
+            if (eq == NULL)
             {
-                QueryStackEntry *orig_entry = (QueryStackEntry *) lfirst(lc);
-                QueryStackEntry *copy_entry;
-        
-                // Выделяем память под новый QueryStackEntry в multi_call_memory_ctx
-                copy_entry = (QueryStackEntry *) palloc(sizeof(QueryStackEntry));
-        
-                // Копируем query_text
-                if (orig_entry->query_text)
-                    copy_entry->query_text = pstrdup(orig_entry->query_text);
-                else
-                    copy_entry->query_text = pstrdup("<unnamed query>");
-        
-                // Добавляем копию в наш список
-                stack_copy = lappend(stack_copy, copy_entry);
+                GUC_check_errdetail("Setting \"%s\" is not in the form name=value.", setting_str);
+                pg_query_stack_overrides_free(rawstring, rule_paths, lappend(rule_settings, settings));
+                return false;
             }
-            
-            // Пропускаем указанное количество элементов
-            while (depth < skip_count && stack_copy != NIL)
+            *eq = '\0';
+            value = eq + 1;
+
+            // Обрезаем пробелы вокруг имени и значения
+            while (isspace((unsigned char) *name))
+                name++;
+            end = name + strlen(name);
+            while (end > name && isspace((unsigned char) end[-1]))
+                *--end = '\0';
+            while (isspace((unsigned char) *value))
+                value++;
+            end = value + strlen(value);
+            while (end > value && isspace((unsigned char) end[-1]))
+                *--end = '\0';
+
+            if (*name == '\0')
             {
-                QueryStackEntry *entry = (QueryStackEntry *) linitial(stack_copy);
-        
-                // Освобождаем память под query_text и структуру, так как они больше не нужны
-                pfree(entry->query_text);
-                pfree(entry);
-                stack_copy = list_delete_first(stack_copy);
-                
-                depth++;
+                GUC_check_errdetail("Setting name is empty.");
+                pg_query_stack_overrides_free(rawstring, rule_paths, lappend(rule_settings, settings));
+                return false;
             }
 
-            /* 
-                Переворачиваем список для корректного порядка от 0 (top-level запрос), до N (самый нижний вложенный запрос).
-                И cохраняем копию стека для итерации:
-                - user_fctx — поле для хранения пользовательских данных между вызовами функции
-                ? Копирование необходимо, чтобы обеспечить консистентность данных между вызовами и избежать изменений в оригинальном стеке
-            */
-            funcctx->user_fctx = pg_list_reverse_copy(stack_copy);
-            
-            // Получаем количество уровней стека = по сути кол-во вложенных запросов = а также сколько раз функция будет возвращать данные
-            funcctx->max_calls = list_length((List *) funcctx->user_fctx);
-
-            /* 
-                Создаем описание кортежа при первом вызове
-            */
-            // Описание кортежа (структура возвращаемых данных) из 2х колонок
-            TupleDesc tupdesc = CreateTemplateTupleDesc(2);
-            
-            /*
-                TupleDescInitEntry — инициализируем каждое поле:
-                - Первое поле:
-                    - (AttrNumber) 1 — номер поля.
-                    - "frame_number" — имя поля, уровень вложенности запросов
-                    - INT4OID — тип данных (целое число 4 байта).
-                - Второе поле:
-                    - (AttrNumber) 2 — номер поля.
-                    - "query_text" — имя поля, текст перехваченного запроса их стека
-                    - TEXTOID — тип данных (текст).
-            */
-            TupleDescInitEntry(tupdesc, (AttrNumber) 1, "frame_number", INT4OID, -1, 0);
-            TupleDescInitEntry(tupdesc, (AttrNumber) 2, "query_text", TEXTOID, -1, 0);
-            
-            // Завершаем создание описания кортежа, делая его готовым для использования. Благославляем )))
-            funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+            settings = lappend(settings, list_make2(name, value));
+            names_size += strlen(name) + strlen(value) + 2;
         }
-        else
+
+        if (settings == NIL)
         {
-            // Если у нас пустой стек то и делать нечего...
-            funcctx->user_fctx = NIL;
-            funcctx->max_calls = 0;
+            GUC_check_errdetail("Rule for \"%s\" has no settings.", rule_str);
+            pg_query_stack_overrides_free(rawstring, rule_paths, rule_settings);
+            return false;
         }
 
-        // Восстанавливаем предыдущий контекст памяти
-        MemoryContextSwitchTo(oldcontext);
+        foreach(lc, path)
+            names_size += strlen((char *) lfirst(lc)) + 1;
+
+        nelems += list_length(path);
+        nsettings += list_length(settings);
+        rule_settings = lappend(rule_settings, settings);
     }
 
-    /*
-        Устанавливает funcctx для текущего вызова функции:
-        - SRF_PERCALL_SETUP() — макрос, который восстанавливает контекст вызова функции между вызовами
-        - Необходимо для правильной работы SRF, чтобы иметь доступ к состоянию между вызовами
-    */
-    funcctx = SRF_PERCALL_SETUP();
-    
-    // Получаем наш скопированный стек из контекста
-    List       *stack = (List *) funcctx->user_fctx;
-    
-    if (stack == NIL)
+    if (nelems > MAX_OVERRIDE_ELEMS)
     {
-        // Сразу выходим из функции если вдруг стек пустой
-        SRF_RETURN_DONE(funcctx);
+        GUC_check_errdetail("At most %d functions may be listed in all call paths.", MAX_OVERRIDE_ELEMS);
+        pg_query_stack_overrides_free(rawstring, rule_paths, rule_settings);
+        return false;
     }
-    
-    /*
-        Получаем текущий номер вызова (call_cntr)
-        ? call_cntr автоматически увеличивается PostgreSQL при каждом вызове функции в SRF. Начинается с 0 (как и массивы/списки в С)
-    */
-    int         call_cntr = funcctx->call_cntr;
 
-    // Пока текущий номер вызова не достиг крайнего - возвращаем следующую строчку
-    if (call_cntr < funcctx->max_calls)
+    size = MAXALIGN(sizeof(QueryStackOverrides)) +
+           MAXALIGN(list_length(rule_paths) * sizeof(QueryStackOverrideRule)) +
+           MAXALIGN(nelems * sizeof(QueryStackScopeRule)) +
+           MAXALIGN(nsettings * sizeof(QueryStackOverrideSetting)) +
+           names_size;
+
+    result = (QueryStackOverrides *) guc_malloc(LOG, size);
+    if (result == NULL)
     {
-        /*
-            Объявление переменных для формирования и возвращения результата
-        */
-        // Массив значений для полей кортежа
-        Datum            values[2];
-        // Массив флагов NULL для полей (здесь все значения не NULL)
-        bool             nulls[2] = {false, false};
-        // Непосредственно сам кортеж (строка) для возвращения
-        HeapTuple        tuple;
-        
-        /* 
-            Получаем элемент стека запросов, соответствующий текущему номеру вызова:
-            - list_nth(stack, call_cntr); возвращает call_cntr-й элемент списка stack
-            - Приводим возвращенный указатель к `QueryStackEntry *`, чтобы работать с его полями
-        */
-        QueryStackEntry *entry = (QueryStackEntry *) list_nth(stack, call_cntr);
-        
-        // Уровень вложенности запроса
-        int frame_number = call_cntr;
-        // Получаем текст запроса
-        const char *query_text = entry->query_text;
+        pg_query_stack_overrides_free(rawstring, rule_paths, rule_settings);
+        return false;
+    }
 
-        // Подстраховка, если вдруг запрос не получен
-        if (query_text == NULL || query_text[0] == '\0')
-            query_text = "<unnamed query>";
+    result->nrules = list_length(rule_paths);
+    result->nelems = nelems;
+    result->nsettings = nsettings;
+    result->rules = (QueryStackOverrideRule *) ((char *) result + MAXALIGN(sizeof(QueryStackOverrides)));
+    result->elems = (QueryStackScopeRule *) ((char *) result->rules +
+                                             MAXALIGN(result->nrules * sizeof(QueryStackOverrideRule)));
+    result->settings = (QueryStackOverrideSetting *) ((char *) result->elems +
+                                                      MAXALIGN(nelems * sizeof(QueryStackScopeRule)));
+    result->names = (char *) result->settings + MAXALIGN(nsettings * sizeof(QueryStackOverrideSetting));
 
-        /*
-            Заполняем массив values значениями для текущего кортежа (строки).
-            - values[0] — значение для первого поля "frame_number":
-                - Возвращаем frame_number
-                - Int32GetDatum преобразует int32 в Datum.
-            - values[1] — значение для второго поля "query_text":
-                - query_text содержит текст текущего запроса.
-                - CStringGetTextDatum преобразует C-строку в Datum типа text.
-        */
-        values[0] = Int32GetDatum(frame_number);
-        values[1] = CStringGetTextDatum(query_text);
+    forboth(lc, rule_paths, lc2, rule_settings)
+    {
+        QueryStackOverrideRule *rule = &result->rules[ri++];
+        ListCell   *item;
 
-        /* 
-            Создаем кортеж (строку) из описания кортежа и значений полей.
-            heap_form_tuple объединяет описание кортежа, значения полей и информацию о NULL в один объект HeapTuple.
-        */
-        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        rule->first_elem = ei;
+        rule->nelems = list_length((List *) lfirst(lc));
+        rule->first_setting = si;
+        rule->nsettings = list_length((List *) lfirst(lc2));
 
-        /*
-            Преобразуем HeapTuple в Datum, чтобы вернуть его из функции. HeapTupleGetDatum оборачивает кортеж в Datum.
-            ? Функции PostgreSQL на языке C должны возвращать значения типа Datum.
-        
-            Затем возвращаем текущий результат и указываем, что есть еще данные для возвращения.
-            SRF_RETURN_NEXT — макрос, который:
-                - Увеличивает счетчик вызовов (call_cntr).
-                - Возвращает управление в цикл исполнения PostgreSQL.
-                - Обеспечивает корректное поведение SRF, позволяя функции быть вызванной снова для следующего результата.
-        */
-        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
-    }
-    else
-    {
-        /*
-            Когда все результаты уже возвращены (call_cntr >= max_calls):
-            - SRF_RETURN_DONE(funcctx); — макрос, который сообщает PostgreSQL, что функция завершила возвращение всех данных.
-        */
-        SRF_RETURN_DONE(funcctx);
+        foreach(item, (List *) lfirst(lc))
+        {
+            char       *elem = (char *) lfirst(item);
+            char       *dot = strrchr(elem, '.');
+            Size        len = strlen(elem);
+
+            memcpy(result->names + off, elem, len + 1);
+
+            // "схема.имя": разрезаем строку на месте по последней точке
+            if (dot != NULL)
+            {
+                result->names[off + (dot - elem)] = '\0';
+                result->elems[ei].schema_off = off;
+                result->elems[ei].name_off = off + (dot - elem) + 1;
+            }
+            else
+            {
+                result->elems[ei].schema_off = -1;
+                result->elems[ei].name_off = off;
+            }
+
+            off += len + 1;
+            ei++;
+        }
+
+        foreach(item, (List *) lfirst(lc2))
+        {
+            List       *pair = (List *) lfirst(item);
+            char       *name = (char *) linitial(pair);
+            char       *value = (char *) lsecond(pair);
+
+            result->settings[si].name_off = off;
+            strcpy(result->names + off, name);
+            off += strlen(name) + 1;
+            result->settings[si].value_off = off;
+            strcpy(result->names + off, value);
+            off += strlen(value) + 1;
+            si++;
+        }
+    }
+
+    pg_query_stack_overrides_free(rawstring, rule_paths, rule_settings);
+
+    *extra = result;
+    return true;
+}
+
+
+static void
+pg_query_stack_overrides_assign(const char *newval, void *extra)
+{
+    override_rules = (QueryStackOverrides *) extra;
+    ScopeFuncCacheValid = false;
+}
+
+
+/*
+    Подходит ли правило к только что начатому вызову (голова PL_Call_Stack): последний элемент пути - сама функция,
+    остальные должны встретиться выше по стеку вызовов в том же порядке (промежуточные вызовы допускаются).
+*/
+static bool
+pg_query_stack_override_matches(QueryStackOverrideRule *rule)
+{
+    int         k = rule->nelems - 1;
+    ListCell   *lc;
+
+    foreach(lc, PL_Call_Stack)
+    {
+        QueryStackPLCall *call = (QueryStackPLCall *) lfirst(lc);
+
+        if (call->override_mask & (UINT64CONST(1) << (rule->first_elem + k)))
+        {
+            if (--k < 0)
+                return true;
+        }
+        else if (foreach_current_index(lc) == 0)
+            return false;
+    }
+
+    return false;
+}
+
+
+/*
+    Применение переопределений к только что начатому вызову: на новом уровне вложенности GUC,
+    как это делает SET у функции (fmgr_security_definer). Неверное значение не должно ломать саму функцию,
+    поэтому ошибки установки выводятся как WARNING. Правила задаёт суперпользователь, поэтому применяем их с PGC_SUSET.
+*/
+static void
+pg_query_stack_apply_overrides(QueryStackPLCall *call)
+{
+    int         i;
+
+    call->guc_nestlevel = 0;
+
+    if (call->override_mask == 0)
+        return;
+
+    for (i = 0; i < override_rules->nrules; i++)
+    {
+        QueryStackOverrideRule *rule = &override_rules->rules[i];
+        int         j;
+
+        if (!pg_query_stack_override_matches(rule))
+            continue;
+
+        if (call->guc_nestlevel == 0)
+            call->guc_nestlevel = NewGUCNestLevel();
+
+        for (j = rule->first_setting; j < rule->first_setting + rule->nsettings; j++)
+        {
+            QueryStackOverrideSetting *setting = &override_rules->settings[j];
+
+            (void) set_config_option(override_rules->names + setting->name_off,
+                                     override_rules->names + setting->value_off,
+                                     PGC_SUSET, PGC_S_SESSION,
+                                     GUC_ACTION_SAVE, true, WARNING, false);
+        }
+    }
+}
+
+
+// При изменении pg_proc (переименование, перенос в другую схему) просто сбрасываем кэш сопоставлений
+static void
+pg_query_stack_scope_cache_inval(Datum arg, int cacheid, uint32 hashvalue)
+{
+    ScopeFuncCacheValid = false;
+}
+
+
+// Совпадает ли функция с элементом правила (имя или схема.имя)
+static bool
+pg_query_stack_rule_name_matches(const char *names, QueryStackScopeRule *rule,
+                                 const char *proname, const char *nspname)
+{
+    return strcmp(names + rule->name_off, proname) == 0 &&
+           (rule->schema_off < 0 || (nspname != NULL && strcmp(names + rule->schema_off, nspname) == 0));
+}
+
+
+/*
+    Сопоставление функции с правилами capture_functions и overrides (с кэшированием результата по oid).
+    NULL - правил нет.
+*/
+static QueryStackScopeCacheEntry *
+pg_query_stack_function_lookup(Oid fn_oid)
+{
+    QueryStackScopeCacheEntry *cache_entry;
+    bool        found;
+
+    if ((capture_scope_rules == NULL || capture_scope_rules->nrules == 0) &&
+        (override_rules == NULL || override_rules->nrules == 0))
+        return NULL;
+
+    if (ScopeFuncCache == NULL || !ScopeFuncCacheValid)
+    {
+        HASHCTL     ctl;
+
+        if (ScopeFuncCache == NULL)
+            CacheRegisterSyscacheCallback(PROCOID, pg_query_stack_scope_cache_inval, (Datum) 0);
+        else
+            hash_destroy(ScopeFuncCache);
+
+        ctl.keysize = sizeof(Oid);
+        ctl.entrysize = sizeof(QueryStackScopeCacheEntry);
+        ScopeFuncCache = hash_create("pg_query_stack scope cache", 64, &ctl, HASH_ELEM | HASH_BLOBS);
+        ScopeFuncCacheValid = true;
+    }
+
+    cache_entry = (QueryStackScopeCacheEntry *) hash_search(ScopeFuncCache, &fn_oid, HASH_ENTER, &found);
+
+    if (!found)
+    {
+        char       *proname = get_func_name(fn_oid);
+        char       *nspname = proname ? get_namespace_name(get_func_namespace(fn_oid)) : NULL;
+        int         i;
+
+        cache_entry->matched = false;
+        cache_entry->override_mask = 0;
+
+        for (i = 0; proname != NULL && capture_scope_rules != NULL && i < capture_scope_rules->nrules; i++)
+        {
+            if (pg_query_stack_rule_name_matches(ScopeRulesNames(capture_scope_rules),
+                                                 &capture_scope_rules->rules[i], proname, nspname))
+            {
+                cache_entry->matched = true;
+                break;
+            }
+        }
+
+        for (i = 0; proname != NULL && override_rules != NULL && i < override_rules->nelems; i++)
+        {
+            if (pg_query_stack_rule_name_matches(override_rules->names, &override_rules->elems[i], proname, nspname))
+                cache_entry->override_mask |= UINT64CONST(1) << i;
+        }
+    }
+
+    return cache_entry;
+}
+
+
+/*
+    Структурный хэш дерева плана: типы узлов в порядке обхода и OID-ы таблиц и индексов, которые они читают.
+    Параметры, стоимости и оценки в хэш не входят, поэтому хэш меняется только при смене формы плана
+    (другой порядок соединений, другой метод доступа, другой индекс).
+*/
+static uint64
+pg_query_stack_plan_hash_walk(Plan *plan, List *rtable, uint64 hash)
+{
+    ListCell   *lc;
+    List       *children = NIL;
+    Index       scanrelid = 0;
+    Oid         indexid = InvalidOid;
+
+    if (plan == NULL)
+        return hash;
+
+    check_stack_depth();
+
+    hash = hash_combine64(hash, (uint64) nodeTag(plan));
+
+    switch (nodeTag(plan))
+    {
+        case T_SeqScan:
+        case T_SampleScan:
+        case T_BitmapHeapScan:
+        case T_TidScan:
+        case T_TidRangeScan:
+        case T_ForeignScan:
+            scanrelid = ((Scan *) plan)->scanrelid;
+            break;
+        case T_IndexScan:
+            scanrelid = ((Scan *) plan)->scanrelid;
+            indexid = ((IndexScan *) plan)->indexid;
+            break;
+        case T_IndexOnlyScan:
+            scanrelid = ((Scan *) plan)->scanrelid;
+            indexid = ((IndexOnlyScan *) plan)->indexid;
+            break;
+        case T_BitmapIndexScan:
+            indexid = ((BitmapIndexScan *) plan)->indexid;
+            break;
+        case T_ModifyTable:
+            scanrelid = ((ModifyTable *) plan)->nominalRelation;
+            break;
+        case T_Append:
+            children = ((Append *) plan)->appendplans;
+            break;
+        case T_MergeAppend:
+            children = ((MergeAppend *) plan)->mergeplans;
+            break;
+        case T_BitmapAnd:
+            children = ((BitmapAnd *) plan)->bitmapplans;
+            break;
+        case T_BitmapOr:
+            children = ((BitmapOr *) plan)->bitmapplans;
+            break;
+        case T_SubqueryScan:
+            hash = pg_query_stack_plan_hash_walk(((SubqueryScan *) plan)->subplan, rtable, hash);
+            break;
+        case T_CustomScan:
+            children = ((CustomScan *) plan)->custom_plans;
+            break;
+        default:
+            break;
+    }
+
+    if (scanrelid > 0 && scanrelid <= list_length(rtable))
+        hash = hash_combine64(hash, (uint64) rt_fetch(scanrelid, rtable)->relid);
+
+    if (OidIsValid(indexid))
+        hash = hash_combine64(hash, (uint64) indexid);
+
+    foreach(lc, children)
+        hash = pg_query_stack_plan_hash_walk((Plan *) lfirst(lc), rtable, hash);
+
+    hash = pg_query_stack_plan_hash_walk(plan->lefttree, rtable, hash);
+    hash = pg_query_stack_plan_hash_walk(plan->righttree, rtable, hash);
+
+    return hash;
+}
+
+
+static uint64
+pg_query_stack_plan_hash(PlannedStmt *stmt)
+{
+    uint64      hash;
+    ListCell   *lc;
+
+    if (stmt == NULL)
+        return 0;
+
+    hash = pg_query_stack_plan_hash_walk(stmt->planTree, stmt->rtable, (uint64) stmt->commandType);
+
+    // Подпланы (SubPlan и InitPlan) лежат отдельным списком, часть элементов может быть NULL
+    foreach(lc, stmt->subplans)
+        hash = pg_query_stack_plan_hash_walk((Plan *) lfirst(lc), stmt->rtable, hash);
+
+    return hash;
+}
+
+
+// Сколько миллисекунд прошло с добавления кадра
+static double
+pg_query_stack_frame_elapsed(QueryStackEntry *entry)
+{
+    instr_time  duration;
+
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, entry->start_time);
+
+    return INSTR_TIME_GET_MILLISEC(duration);
+}
+
+
+/*
+    Короткая подпись кадра для текстового представления стека: начало текста запроса
+    (не более STACK_FRAME_TEXT_LEN символов) со схлопнутыми пробельными символами.
+*/
+static void
+pg_query_stack_append_frame_label(StringInfo buf, const char *text)
+{
+    int         written = 0;
+    bool        pending_space = false;
+
+    if (text == NULL)
+    {
+        appendStringInfoString(buf, "<...>");
+        return;
+    }
+
+    while (*text != '\0' && written < STACK_FRAME_TEXT_LEN)
+    {
+        int         len;
+
+        if (isspace((unsigned char) *text))
+        {
+            pending_space = true;
+            text++;
+            continue;
+        }
+
+        if (pending_space && written > 0)
+        {
+            appendStringInfoChar(buf, ' ');
+            written++;
+        }
+        pending_space = false;
+
+        // Копируем символ целиком, чтобы не разрезать многобайтовые символы
+        len = pg_mblen(text);
+        appendBinaryStringInfo(buf, text, len);
+        text += len;
+        written++;
+    }
+}
+
+
+/*
+    Текстовое представление стека от верхнего уровня до кадра frame: подписи кадров через separator,
+    не длиннее maxlen байт (с учётом завершающего нуля).
+*/
+static char *
+pg_query_stack_format_stack(QueryStackEntry *frame, const char *separator, int maxlen)
+{
+    StringInfoData buf;
+    QueryStackEntry **chain;
+    QueryStackEntry *f;
+    int         n = 0;
+    int         i;
+
+    for (f = frame; f != NULL; f = f->parent)
+        n++;
+
+    chain = (QueryStackEntry **) palloc(Max(n, 1) * sizeof(QueryStackEntry *));
+    i = n;
+    for (f = frame; f != NULL; f = f->parent)
+        chain[--i] = f;
+
+    initStringInfo(&buf);
+    for (i = 0; i < n && buf.len < maxlen; i++)
+    {
+        if (i > 0)
+            appendStringInfoString(&buf, separator);
+        pg_query_stack_append_frame_label(&buf, chain[i]->query_text);
+    }
+
+    pfree(chain);
+
+    if (buf.len >= maxlen)
+    {
+        buf.len = pg_mbcliplen(buf.data, buf.len, maxlen - 1);
+        buf.data[buf.len] = '\0';
+    }
+
+    return buf.data;
+}
+
+
+// Имя операции для обратного индекса записей
+static const char *
+pg_query_stack_operation_name(CmdType operation)
+{
+    switch (operation)
+    {
+        case CMD_INSERT:
+            return "insert";
+        case CMD_UPDATE:
+            return "update";
+        case CMD_DELETE:
+            return "delete";
+        case CMD_MERGE:
+            return "merge";
+        case CMD_SELECT:
+            // SELECT с изменяющим данные CTE
+            return "cte";
+        default:
+            return "other";
+    }
+}
+
+
+/*
+    Учёт записей запроса в локальной таблице транзакции. Вызывается в ExecutorEnd до standard_ExecutorEnd,
+    пока результирующие таблицы ещё открыты. Секции и наследники учитываются под корневой таблицей,
+    количество строк - es_processed всего запроса.
+*/
+static void
+pg_query_stack_record_writes(QueryDesc *queryDesc, QueryStackEntry *entry)
+{
+    EState     *estate = queryDesc->estate;
+    MemoryContext oldcontext;
+    ListCell   *lc;
+    double      total_time;
+
+    if (estate == NULL || estate->es_opened_result_relations == NIL)
+        return;
+
+    total_time = pg_query_stack_frame_elapsed(entry);
+
+    oldcontext = MemoryContextSwitchTo(pg_query_stack_get_context());
+
+    if (PendingWrites == NULL)
+    {
+        HASHCTL     ctl;
+
+        ctl.keysize = sizeof(QueryStackPendingWriteKey);
+        ctl.entrysize = sizeof(QueryStackPendingWrite);
+        ctl.hcxt = QueryStackContext;
+        PendingWrites = hash_create("pg_query_stack pending writes", 16, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    foreach(lc, estate->es_opened_result_relations)
+    {
+        ResultRelInfo *rri = (ResultRelInfo *) lfirst(lc);
+        QueryStackPendingWriteKey key;
+        QueryStackPendingWrite *pending;
+        bool        found;
+
+        if (rri->ri_RootResultRelInfo != NULL)
+            continue;
+
+        // Ключ сравнивается побайтно, поэтому обнуляем выравнивание
+        memset(&key, 0, sizeof(key));
+        key.key.path_hash = entry->path_hash;
+        key.key.dbid = MyDatabaseId;
+        key.key.relid = RelationGetRelid(rri->ri_RelationDesc);
+        key.key.operation = (int32) queryDesc->operation;
+        key.subid = GetCurrentSubTransactionId();
+
+        pending = (QueryStackPendingWrite *) hash_search(PendingWrites, &key, HASH_ENTER, &found);
+
+        if (!found)
+        {
+            memset(&pending->counters, 0, sizeof(QueryStackWriteCounters));
+            pending->stack_text = pg_query_stack_format_stack(entry, " > ", STACK_TEXT_LEN);
+            pending->flushed = false;
+        }
+
+        pending->counters.calls++;
+        pending->counters.rows += estate->es_processed;
+        pending->counters.total_time += total_time;
+    }
+
+    MemoryContextSwitchTo(oldcontext);
+}
+
+
+// Добавление счётчиков транзакции в запись общей таблицы (под спин-блокировкой записи)
+static void
+pg_query_stack_write_counters_add(QueryStackSharedWrite *shared, const QueryStackWriteCounters *src)
+{
+    SpinLockAcquire(&shared->mutex);
+    shared->counters.calls += src->calls;
+    shared->counters.rows += src->rows;
+    shared->counters.total_time += src->total_time;
+    SpinLockRelease(&shared->mutex);
+}
+
+
+// Откат подтранзакции: её записи (и записи вложенных в неё) в обратный индекс не попадут
+static void
+pg_query_stack_discard_writes(SubTransactionId mySubid)
+{
+    HASH_SEQ_STATUS status;
+    QueryStackPendingWrite *pending;
+
+    if (PendingWrites == NULL)
+        return;
+
+    // Удалять текущую запись во время обхода dynahash разрешает
+    hash_seq_init(&status, PendingWrites);
+    while ((pending = (QueryStackPendingWrite *) hash_seq_search(&status)) != NULL)
+    {
+        if (pending->key.subid >= mySubid)
+            hash_search(PendingWrites, &pending->key, HASH_REMOVE, NULL);
+    }
+}
+
+
+/*
+    Сброс накопленных за транзакцию записей в общую таблицу (при COMMIT).
+    Существующие ключи обновляются под разделяемой блокировкой, так что параллельные COMMIT-ы не выстраиваются в очередь;
+    исключительная блокировка берётся, только если у транзакции есть новые ключи.
+    Вызывается уже после фиксации, поэтому ошибок здесь быть не должно: при заполненной общей таблице новые ключи просто теряются.
+*/
+static void
+pg_query_stack_flush_writes(void)
+{
+    HASH_SEQ_STATUS status;
+    QueryStackPendingWrite *pending;
+    bool        missing = false;
+
+    if (PendingWrites == NULL || SharedState == NULL)
+        return;
+
+    LWLockAcquire(SharedState->lock, LW_SHARED);
+
+    hash_seq_init(&status, PendingWrites);
+    while ((pending = (QueryStackPendingWrite *) hash_seq_search(&status)) != NULL)
+    {
+        QueryStackSharedWrite *shared;
+
+        shared = (QueryStackSharedWrite *) hash_search(SharedWritesHash, &pending->key.key, HASH_FIND, NULL);
+        if (shared == NULL)
+        {
+            missing = true;
+            continue;
+        }
+
+        pg_query_stack_write_counters_add(shared, &pending->counters);
+        pending->flushed = true;
+    }
+
+    LWLockRelease(SharedState->lock);
+
+    if (!missing)
+        return;
+
+    LWLockAcquire(SharedState->lock, LW_EXCLUSIVE);
+
+    hash_seq_init(&status, PendingWrites);
+    while ((pending = (QueryStackPendingWrite *) hash_seq_search(&status)) != NULL)
+    {
+        QueryStackSharedWrite *shared;
+        bool        found;
+
+        if (pending->flushed)
+            continue;
+
+        // Ключ мог появиться, пока блокировка была отпущена, - тогда found вернётся true
+        shared = (QueryStackSharedWrite *) hash_search(SharedWritesHash, &pending->key.key, HASH_ENTER_NULL, &found);
+        if (shared == NULL)
+            continue;
+
+        if (!found)
+        {
+            SpinLockInit(&shared->mutex);
+            memset(&shared->counters, 0, sizeof(QueryStackWriteCounters));
+            strlcpy(shared->stack_text, pending->stack_text, STACK_TEXT_LEN);
+        }
+
+        pg_query_stack_write_counters_add(shared, &pending->counters);
+    }
+
+    LWLockRelease(SharedState->lock);
+}
+
+
+// Создание (при необходимости) хэш-таблицы профиля в долгоживущем контексте сессии
+static void
+pg_query_stack_profile_init(void)
+{
+    HASHCTL     ctl;
+
+    if (ProfileHash != NULL)
+        return;
+
+    if (ProfileContext == NULL)
+        ProfileContext = AllocSetContextCreate(TopMemoryContext,
+                                               "pg_query_stack profile",
+                                               ALLOCSET_DEFAULT_SIZES);
+
+    ctl.keysize = sizeof(QueryStackProfileKey);
+    ctl.entrysize = sizeof(QueryStackProfileEntry);
+    ctl.hcxt = ProfileContext;
+    ProfileHash = hash_create("pg_query_stack profile", 256, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    ctl.keysize = sizeof(uint64);
+    ctl.entrysize = sizeof(uint64);
+    WarmupTextHash = hash_create("pg_query_stack warm-up texts", 256, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    ctl.keysize = sizeof(Oid);
+    ctl.entrysize = sizeof(QueryStackFuncProfileEntry);
+    FuncProfileHash = hash_create("pg_query_stack function profile", 64, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    ctl.keysize = sizeof(QueryStackDynamicPlanKey);
+    ctl.entrysize = sizeof(QueryStackDynamicPlanEntry);
+    DynamicPlanHash = hash_create("pg_query_stack dynamic plans", 64, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+
+/*
+    Первое ли это выполнение текста запроса в сессии.
+    Когда множество заполнено (4 * profile_max текстов), новые тексты прогревом не считаются.
+*/
+static bool
+pg_query_stack_warmup_first_exec(uint64 text_hash)
+{
+    bool        found;
+
+    pg_query_stack_profile_init();
+
+    if (hash_search(WarmupTextHash, &text_hash, HASH_FIND, NULL) != NULL)
+        return false;
+
+    if (hash_get_num_entries(WarmupTextHash) >= (long) profile_max * 4)
+        return false;
+
+    (void) hash_search(WarmupTextHash, &text_hash, HASH_ENTER, &found);
+
+    return true;
+}
+
+
+// Первый ли это вызов функции в сессии после её (пере)компиляции
+static bool
+pg_query_stack_warmup_first_call(PLpgSQL_function *func)
+{
+    QueryStackFuncProfileEntry *fentry;
+    bool        found;
+
+    pg_query_stack_profile_init();
+
+    fentry = (QueryStackFuncProfileEntry *) hash_search(FuncProfileHash, &func->fn_oid, HASH_FIND, NULL);
+
+    if (fentry == NULL)
+    {
+        if (hash_get_num_entries(FuncProfileHash) >= profile_max)
+            return false;
+
+        fentry = (QueryStackFuncProfileEntry *) hash_search(FuncProfileHash, &func->fn_oid, HASH_ENTER, &found);
+        fentry->compiles = 0;
+        fentry->warmup_calls = 0;
+        fentry->warmup_time = 0.0;
+        fentry->calls = 0;
+        fentry->total_time = 0.0;
+    }
+    else if (fentry->fn_xmin == func->fn_xmin && ItemPointerEquals(&fentry->fn_tid, &func->fn_tid))
+        return false;
+
+    fentry->fn_xmin = func->fn_xmin;
+    fentry->fn_tid = func->fn_tid;
+    fentry->compiles++;
+
+    return true;
+}
+
+
+// Учёт завершившегося вызова функции PL/pgSQL (вызовы, прерванные ошибкой, не учитываются)
+static void
+pg_query_stack_func_account(QueryStackPLCall *call, PLpgSQL_function *func)
+{
+    QueryStackFuncProfileEntry *fentry;
+    instr_time  duration;
+    double      elapsed;
+
+    if (FuncProfileHash == NULL)
+        return;
+
+    fentry = (QueryStackFuncProfileEntry *) hash_search(FuncProfileHash, &func->fn_oid, HASH_FIND, NULL);
+    if (fentry == NULL)
+        return;
+
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, call->start_time);
+    elapsed = INSTR_TIME_GET_MILLISEC(duration);
+
+    fentry->calls++;
+    fentry->total_time += elapsed;
+    if (call->first_call)
+    {
+        fentry->warmup_calls++;
+        fentry->warmup_time += elapsed;
+    }
+}
+
+
+// Учёт времени в гистограмме
+static void
+pg_query_stack_hist_add(QueryStackHistogram *hist, double time)
+{
+    double      us = time * 1000.0;
+    int         bucket = 0;
+
+    if (us > 1.0)
+        bucket = Min((int) ceil(log(us) / log(HIST_GAMMA)), HIST_BUCKETS - 1);
+
+    hist->buckets[bucket]++;
+    if (time > hist->max_time)
+        hist->max_time = time;
+}
+
+
+// Квантиль q (0..1) по гистограмме, мс. Значение корзины - середина её интервала с относительной ошибкой ~5%
+static bool
+pg_query_stack_hist_quantile(const QueryStackHistogram *hist, double q, double *result)
+{
+    uint64      count = 0;
+    uint64      cum = 0;
+    double      rank;
+    int         i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        count += hist->buckets[i];
+
+    if (count == 0)
+        return false;
+
+    rank = q * (count - 1);
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        cum += hist->buckets[i];
+        if (cum > rank)
+            break;
+    }
+
+    if (i == 0)
+        *result = 0.001;
+    else
+        *result = 2.0 * pow(HIST_GAMMA, i) / (HIST_GAMMA + 1.0) / 1000.0;
+
+    // Последняя корзина открыта сверху, а максимум известен точно
+    *result = Min(*result, hist->max_time);
+
+    return true;
+}
+
+
+// Учёт завершившегося кадра в счётчиках
+static void
+pg_query_stack_counters_account(QueryStackCounters *c, QueryStackEntry *entry, double total_time, double self_time)
+{
+    c->calls++;
+    c->total_time += total_time;
+    c->self_time += self_time;
+    if (entry->first_exec)
+    {
+        c->warmup_calls++;
+        c->warmup_time += total_time;
+    }
+    c->rows += entry->rows;
+
+    if (entry->jit.created_functions > 0)
+    {
+        c->jit_functions += entry->jit.created_functions;
+        c->jit_generation_time += INSTR_TIME_GET_MILLISEC(entry->jit.generation_counter);
+        c->jit_inlining_time += INSTR_TIME_GET_MILLISEC(entry->jit.inlining_counter);
+        c->jit_optimization_time += INSTR_TIME_GET_MILLISEC(entry->jit.optimization_counter);
+        c->jit_emission_time += INSTR_TIME_GET_MILLISEC(entry->jit.emission_counter);
+    }
+
+    /*
+        Ошибка оценки числа строк. Если план выполнялся порциями, строк могло быть получено меньше, чем он вернул бы целиком,
+        поэтому такое выполнение учитываем, только когда строк оказалось не меньше оценки.
+    */
+    if (entry->plan_rows >= 0 && !(entry->run_limited && entry->rows < entry->plan_rows))
+    {
+        double      log_ratio = log(Max((double) entry->rows, 1.0) / Max(entry->plan_rows, 1.0));
+
+        c->est_calls++;
+        c->est_rows += entry->plan_rows;
+        c->est_actual_rows += entry->rows;
+        c->est_log_ratio += log_ratio;
+        c->est_abs_log_ratio += fabs(log_ratio);
+    }
+
+    pg_query_stack_hist_add(&c->histogram, total_time);
+}
+
+
+/*
+    Оценка числа строк, сравнимая с es_processed: у ModifyTable без RETURNING оценка нулевая,
+    а es_processed - число изменённых строк, поэтому берём оценку его входного плана. -1 - плана нет.
+*/
+static double
+pg_query_stack_estimated_rows(PlannedStmt *stmt)
+{
+    Plan       *plan;
+
+    if (stmt == NULL || stmt->planTree == NULL)
+        return -1;
+
+    plan = stmt->planTree;
+    if (IsA(plan, ModifyTable) && outerPlan(plan) != NULL)
+        plan = outerPlan(plan);
+
+    return plan->plan_rows;
+}
+
+
+// Сложение счётчиков (объединение профилей)
+static void
+pg_query_stack_counters_add(QueryStackCounters *dst, const QueryStackCounters *src)
+{
+    int         i;
+
+    dst->calls += src->calls;
+    dst->total_time += src->total_time;
+    dst->self_time += src->self_time;
+    dst->rows += src->rows;
+    dst->jit_functions += src->jit_functions;
+    dst->jit_generation_time += src->jit_generation_time;
+    dst->jit_inlining_time += src->jit_inlining_time;
+    dst->jit_optimization_time += src->jit_optimization_time;
+    dst->jit_emission_time += src->jit_emission_time;
+    dst->warmup_calls += src->warmup_calls;
+    dst->warmup_time += src->warmup_time;
+    dst->est_calls += src->est_calls;
+    dst->est_rows += src->est_rows;
+    dst->est_actual_rows += src->est_actual_rows;
+    dst->est_log_ratio += src->est_log_ratio;
+    dst->est_abs_log_ratio += src->est_abs_log_ratio;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->histogram.buckets[i] += src->histogram.buckets[i];
+    dst->histogram.max_time = Max(dst->histogram.max_time, src->histogram.max_time);
+}
+
+
+// Копия начала текста запроса (не длиннее maxlen байт, не разрезая многобайтовые символы)
+static char *
+pg_query_stack_clip_text(MemoryContext context, const char *text, int maxlen)
+{
+    int         len = strlen(text);
+    char       *result;
+
+    len = pg_mbcliplen(text, len, maxlen);
+    result = (char *) MemoryContextAlloc(context, len + 1);
+    memcpy(result, text, len);
+    result[len] = '\0';
+
+    return result;
+}
+
+
+// Учёт кадра в таблице транзакции для общего профиля
+static void
+pg_query_stack_pending_profile_account(QueryStackEntry *entry, double total_time, double self_time)
+{
+    QueryStackSharedProfileKey key;
+    QueryStackPendingProfile *pending;
+    bool        found;
+
+    if (PendingProfile == NULL)
+    {
+        HASHCTL     ctl;
+
+        ctl.keysize = sizeof(QueryStackSharedProfileKey);
+        ctl.entrysize = sizeof(QueryStackPendingProfile);
+        ctl.hcxt = pg_query_stack_get_context();
+        PendingProfile = hash_create("pg_query_stack pending profile", 16, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.path_hash = entry->path_hash;
+    key.plan_hash = entry->plan_hash;
+    key.dbid = MyDatabaseId;
+
+    pending = (QueryStackPendingProfile *) hash_search(PendingProfile, &key, HASH_FIND, NULL);
+
+    if (pending == NULL)
+    {
+        // Больше путей, чем вмещает общий профиль, транзакция всё равно не перенесёт
+        if (hash_get_num_entries(PendingProfile) >= shared_profile_max)
+        {
+            pg_atomic_fetch_add_u64(&SharedState->profile_dropped, 1);
+            return;
+        }
+
+        pending = (QueryStackPendingProfile *) hash_search(PendingProfile, &key, HASH_ENTER, &found);
+        pending->parent_path_hash = entry->parent ? entry->parent->path_hash : 0;
+        pending->depth = entry->depth;
+        pending->kind = entry->kind;
+        pending->query_text = entry->query_text ?
+            pg_query_stack_clip_text(pg_query_stack_get_context(), entry->query_text, PROFILE_TEXT_LEN - 1) : NULL;
+        memset(&pending->counters, 0, sizeof(QueryStackCounters));
+        pending->flushed = false;
+    }
+
+    pg_query_stack_counters_account(&pending->counters, entry, total_time, self_time);
+}
+
+
+// Номер текущей эпохи окон профиля
+static int64
+pg_query_stack_current_epoch(void)
+{
+    return GetCurrentTimestamp() / ((int64) window_seconds * USECS_PER_SEC);
+}
+
+
+/*
+    Добавление профиля транзакции в текущее окно.
+    Блокируется только это окно; если окно ещё хранит старую эпоху, оно переходит на текущую одной записью.
+*/
+static void
+pg_query_stack_flush_windows(void)
+{
+    int64       epoch = pg_query_stack_current_epoch();
+    QueryStackWindow *window = SharedWindow(epoch % window_count);
+    HASH_SEQ_STATUS status;
+    QueryStackPendingProfile *pending;
+
+    LWLockAcquire(window->lock, LW_EXCLUSIVE);
+
+    if (window->epoch != epoch)
+    {
+        window->epoch = epoch;
+        window->dropped = 0;
+    }
+
+    hash_seq_init(&status, PendingProfile);
+    while ((pending = (QueryStackPendingProfile *) hash_seq_search(&status)) != NULL)
+    {
+        uint32      start = (uint32) hash_combine64(pending->key.path_hash,
+                                                    pending->key.plan_hash ^ pending->key.dbid);
+        QueryStackWindowEntry *wentry = NULL;
+        int         i;
+
+        for (i = 0; i < window_entries; i++)
+        {
+            QueryStackWindowEntry *probe = &window->entries[(start + i) % window_entries];
+
+            if (probe->epoch != epoch)
+            {
+                // Пустая (или устаревшая) запись - занимаем
+                probe->epoch = epoch;
+                probe->key = pending->key;
+                probe->calls = 0;
+                probe->total_time = 0.0;
+                probe->self_time = 0.0;
+                probe->rows = 0;
+                wentry = probe;
+                break;
+            }
+
+            if (memcmp(&probe->key, &pending->key, sizeof(QueryStackSharedProfileKey)) == 0)
+            {
+                wentry = probe;
+                break;
+            }
+        }
+
+        if (wentry == NULL)
+        {
+            window->dropped += pending->counters.calls;
+            continue;
+        }
+
+        wentry->calls += pending->counters.calls;
+        wentry->total_time += pending->counters.total_time;
+        wentry->self_time += pending->counters.self_time;
+        wentry->rows += pending->counters.rows;
+    }
+
+    LWLockRelease(window->lock);
+}
+
+
+/*
+    Перенос профиля транзакции в общий профиль (при завершении транзакции).
+    Как и в pg_query_stack_flush_writes, существующие пути обновляются под разделяемой блокировкой
+    и спин-блокировкой записи, а исключительная блокировка берётся только для добавления новых путей.
+*/
+static void
+pg_query_stack_flush_profile(void)
+{
+    HASH_SEQ_STATUS status;
+    QueryStackPendingProfile *pending;
+    bool        missing = false;
+
+    if (PendingProfile == NULL || SharedState == NULL)
+        return;
+
+    LWLockAcquire(SharedState->lock, LW_SHARED);
+
+    hash_seq_init(&status, PendingProfile);
+    while ((pending = (QueryStackPendingProfile *) hash_seq_search(&status)) != NULL)
+    {
+        QueryStackSharedProfileEntry *shared;
+
+        shared = (QueryStackSharedProfileEntry *) hash_search(SharedProfileHash, &pending->key, HASH_FIND, NULL);
+        if (shared == NULL)
+        {
+            missing = true;
+            continue;
+        }
+
+        SpinLockAcquire(&shared->mutex);
+        pg_query_stack_counters_add(&shared->counters, &pending->counters);
+        SpinLockRelease(&shared->mutex);
+        pending->flushed = true;
+    }
+
+    LWLockRelease(SharedState->lock);
+
+    if (missing)
+    {
+        LWLockAcquire(SharedState->lock, LW_EXCLUSIVE);
+
+        hash_seq_init(&status, PendingProfile);
+        while ((pending = (QueryStackPendingProfile *) hash_seq_search(&status)) != NULL)
+        {
+            QueryStackSharedProfileEntry *shared;
+            bool        found;
+
+            if (pending->flushed)
+                continue;
+
+            shared = (QueryStackSharedProfileEntry *) hash_search(SharedProfileHash, &pending->key,
+                                                                  HASH_ENTER_NULL, &found);
+            if (shared == NULL)
+            {
+                // Таблица заполнена: новый путь теряется, но потерю видно в profile_dropped
+                pg_atomic_fetch_add_u64(&SharedState->profile_dropped, pending->counters.calls);
+                continue;
+            }
+
+            if (!found)
+            {
+                shared->parent_path_hash = pending->parent_path_hash;
+                shared->depth = pending->depth;
+                shared->kind = pending->kind;
+                SpinLockInit(&shared->mutex);
+                memset(&shared->counters, 0, sizeof(QueryStackCounters));
+                strlcpy(shared->query_text, pending->query_text ? pending->query_text : "", PROFILE_TEXT_LEN);
+            }
+
+            SpinLockAcquire(&shared->mutex);
+            pg_query_stack_counters_add(&shared->counters, &pending->counters);
+            SpinLockRelease(&shared->mutex);
+        }
+
+        LWLockRelease(SharedState->lock);
+    }
+
+    pg_query_stack_flush_windows();
+}
+
+
+/*
+    Учёт завершившегося кадра в профиле путей вызовов сессии и (при наличии общей памяти) в общем профиле.
+    Вызывается при снятии кадра в ExecutorEnd (кадры, снятые из-за ошибки, в профиль не попадают).
+*/
+static void
+pg_query_stack_profile_account(QueryStackEntry *entry)
+{
+    QueryStackProfileKey key;
+    QueryStackProfileEntry *pentry;
+    double      total_time;
+    double      self_time;
+    bool        found;
+
+    total_time = pg_query_stack_frame_elapsed(entry);
+    self_time = Max(total_time - entry->child_time, 0.0);
+
+    // Время кадра для родителя - время дочернего кадра
+    if (entry->parent != NULL)
+        entry->parent->child_time += total_time;
+
+    if (SharedState != NULL)
+        pg_query_stack_pending_profile_account(entry, total_time, self_time);
+
+    pg_query_stack_profile_init();
+
+    key.path_hash = entry->path_hash;
+    key.plan_hash = entry->plan_hash;
+
+    pentry = (QueryStackProfileEntry *) hash_search(ProfileHash, &key, HASH_FIND, NULL);
+
+    if (pentry == NULL)
+    {
+        // Профиль заполнен - новые пути не добавляем, уже известные продолжаем считать
+        if (hash_get_num_entries(ProfileHash) >= profile_max)
+            return;
+
+        pentry = (QueryStackProfileEntry *) hash_search(ProfileHash, &key, HASH_ENTER, &found);
+        pentry->parent_path_hash = entry->parent ? entry->parent->path_hash : 0;
+        pentry->depth = entry->depth;
+        pentry->kind = entry->kind;
+        pentry->query_text = entry->query_text ?
+            pg_query_stack_clip_text(ProfileContext, entry->query_text, PROFILE_TEXT_LEN) : NULL;
+        memset(&pentry->counters, 0, sizeof(QueryStackCounters));
+    }
+
+    pg_query_stack_counters_account(&pentry->counters, entry, total_time, self_time);
+}
+
+
+// Размер структуры со слотами backend-ов
+static Size
+pg_query_stack_state_size(void)
+{
+    Size        slot_size = MAXALIGN(add_size(offsetof(QueryStackBackendSlot, frames),
+                                              mul_size(publish_depth, sizeof(QueryStackSharedFrame))));
+
+    return add_size(MAXALIGN(offsetof(QueryStackSharedState, slots)), mul_size(MaxBackends, slot_size));
+}
+
+
+// Размер общей памяти расширения: слоты backend-ов и общие хэш-таблицы
+static Size
+pg_query_stack_shmem_size(void)
+{
+    Size        size = pg_query_stack_state_size();
+
+    size = add_size(size, hash_estimate_size(writers_max, sizeof(QueryStackSharedWrite)));
+    size = add_size(size, hash_estimate_size(shared_profile_max, sizeof(QueryStackSharedProfileEntry)));
+    size = add_size(size, mul_size(window_count, WindowSize()));
+
+    return size;
+}
+
+
+// Запрос общей памяти (вызывается в postmaster, когда MaxBackends уже известен)
+static void
+pg_query_stack_shmem_request(void)
+{
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    RequestAddinShmemSpace(pg_query_stack_shmem_size());
+    // Общая блокировка и по одной на каждое окно профиля
+    RequestNamedLWLockTranche("pg_query_stack", 1 + window_count);
+}
+
+
+// Создание или подключение к общей памяти
+static void
+pg_query_stack_shmem_startup(void)
+{
+    bool        found;
+    HASHCTL     info;
+    Size        state_size = pg_query_stack_state_size();
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    SharedState = (QueryStackSharedState *) ShmemInitStruct("pg_query_stack", state_size, &found);
+
+    if (!found)
+    {
+        int         i;
+
+        memset(SharedState, 0, state_size);
+        SharedState->lock = &(GetNamedLWLockTranche("pg_query_stack"))->lock;
+        SharedState->nslots = MaxBackends;
+        SharedState->publish_depth = publish_depth;
+        SharedState->slot_size = MAXALIGN(add_size(offsetof(QueryStackBackendSlot, frames),
+                                                   mul_size(publish_depth, sizeof(QueryStackSharedFrame))));
+
+        pg_atomic_init_u64(&SharedState->profile_dropped, 0);
+        for (i = 0; i < SharedState->nslots; i++)
+            pg_atomic_init_u64(&SharedSlot(SharedState, i)->explain_request, 0);
+    }
+
+    SharedWindows = (char *) ShmemInitStruct("pg_query_stack windows", mul_size(window_count, WindowSize()), &found);
+
+    if (!found)
+    {
+        LWLockPadded *locks = GetNamedLWLockTranche("pg_query_stack");
+        int         i;
+
+        memset(SharedWindows, 0, mul_size(window_count, WindowSize()));
+        for (i = 0; i < window_count; i++)
+            SharedWindow(i)->lock = &locks[1 + i].lock;
+    }
+
+    info.keysize = sizeof(QueryStackWriteKey);
+    info.entrysize = sizeof(QueryStackSharedWrite);
+    SharedWritesHash = ShmemInitHash("pg_query_stack writers", writers_max, writers_max, &info, HASH_ELEM | HASH_BLOBS);
+
+    info.keysize = sizeof(QueryStackSharedProfileKey);
+    info.entrysize = sizeof(QueryStackSharedProfileEntry);
+    SharedProfileHash = ShmemInitHash("pg_query_stack profile", shared_profile_max, shared_profile_max,
+                                      &info, HASH_ELEM | HASH_BLOBS);
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+
+// При выходе процесса освобождаем свой слот
+static void
+pg_query_stack_shmem_exit(int code, Datum arg)
+{
+    if (MySlot != NULL)
+    {
+        SLOT_BEGIN_WRITE(MySlot);
+        MySlot->depth = 0;
+        MySlot->pid = 0;
+        SLOT_END_WRITE(MySlot);
+        MySlot = NULL;
+    }
+}
+
+
+// Слот текущего backend-а (занимается при первом обращении). NULL - общей памяти нет
+static QueryStackBackendSlot *
+pg_query_stack_my_slot(void)
+{
+    if (MySlot != NULL)
+        return MySlot;
+
+    // Параллельные исполнители стек не ведут и слот не занимают (см. pg_query_stack_ExecutorStart)
+    if (SharedState == NULL || IsParallelWorker() ||
+        MyBackendId == InvalidBackendId || MyBackendId > SharedState->nslots)
+        return NULL;
+
+    MySlot = SharedSlot(SharedState, MyBackendId - 1);
+
+    // Запрос, адресованный прошлому владельцу слота, к нам не относится
+    pg_atomic_write_u64(&MySlot->explain_request, 0);
+
+    SLOT_BEGIN_WRITE(MySlot);
+    MySlot->pid = MyProcPid;
+    MySlot->dbid = MyDatabaseId;
+    MySlot->userid = GetSessionUserId();
+    MySlot->depth = 0;
+    MySlot->xid = InvalidTransactionId;
+    MySlot->xmin = InvalidTransactionId;
+    SLOT_END_WRITE(MySlot);
+
+    before_shmem_exit(pg_query_stack_shmem_exit, (Datum) 0);
+
+    return MySlot;
+}
+
+
+// Публикация только что добавленного кадра
+static void
+pg_query_stack_publish_push(QueryStackEntry *entry)
+{
+    QueryStackBackendSlot *slot = pg_query_stack_my_slot();
+
+    if (slot == NULL)
+        return;
+
+    SLOT_BEGIN_WRITE(slot);
+    if (entry->depth < SharedState->publish_depth)
+    {
+        slot->frames[entry->depth].path_hash = entry->path_hash;
+        slot->frames[entry->depth].text_hash = entry->text_hash;
+        slot->frames[entry->depth].start_time = GetCurrentTimestamp();
+    }
+    slot->depth = Min(Query_Stack_Depth, SharedState->publish_depth);
+    SLOT_END_WRITE(slot);
+}
+
+
+/*
+    Публикация глубины после снятия кадров.
+    Если кадр был снят не с вершины (курсор закрыт не по порядку), опубликованные кадры сдвигаются - публикуем стек заново.
+*/
+static void
+pg_query_stack_publish_pop(bool republish)
+{
+    QueryStackBackendSlot *slot = MySlot;
+    ListCell   *lc;
+    int         i;
+
+    if (slot == NULL)
+        return;
+
+    SLOT_BEGIN_WRITE(slot);
+    slot->depth = Min(Query_Stack_Depth, SharedState->publish_depth);
+
+    if (republish)
+    {
+        i = Query_Stack_Depth;
+        foreach(lc, Query_Stack)
+        {
+            QueryStackEntry *entry = (QueryStackEntry *) lfirst(lc);
+
+            if (--i < SharedState->publish_depth)
+            {
+                slot->frames[i].path_hash = entry->path_hash;
+                slot->frames[i].text_hash = entry->text_hash;
+            }
+        }
+    }
+    SLOT_END_WRITE(slot);
+}
+
+
+/*
+    Публикация кадров, ответственных за горизонт очистки.
+    xid_frame - кадр, во время работы которого мог быть присвоен xid (NULL - xid присвоен вне отслеживаемых запросов),
+    xmin_frame - кадр, для которого мог быть взят новый снимок.
+*/
+static void
+pg_query_stack_horizon_check(QueryStackEntry *xid_frame, QueryStackEntry *xmin_frame)
+{
+    QueryStackBackendSlot *slot = MySlot;
+    TransactionId xid;
+    TransactionId xmin;
+    bool        xid_changed;
+    bool        xmin_changed;
+    char       *xid_stack = NULL;
+    char       *xmin_stack = NULL;
+    TimestampTz now;
+
+    if (slot == NULL || !track_horizon)
+        return;
+
+    xid = GetTopTransactionIdIfAny();
+    xmin = MyProc->xmin;
+    xid_changed = TransactionIdIsValid(xid) && !TransactionIdEquals(xid, slot->xid);
+    xmin_changed = TransactionIdIsValid(xmin) && !TransactionIdEquals(xmin, slot->xmin) && xmin_frame != NULL;
+
+    if (!xid_changed && !xmin_changed)
+        return;
+
+    if (xid_changed && xid_frame != NULL)
+        xid_stack = pg_query_stack_format_stack(xid_frame, " > ", STACK_TEXT_LEN);
+    if (xmin_changed)
+        xmin_stack = pg_query_stack_format_stack(xmin_frame, " > ", STACK_TEXT_LEN);
+    now = GetCurrentTimestamp();
+
+    SLOT_BEGIN_WRITE(slot);
+    if (xid_changed)
+    {
+        slot->xid = xid;
+        slot->xid_time = now;
+        strlcpy(slot->xid_stack, xid_stack ? xid_stack : "", STACK_TEXT_LEN);
+    }
+    if (xmin_changed)
+    {
+        slot->xmin = xmin;
+        slot->xmin_time = now;
+        strlcpy(slot->xmin_stack, xmin_stack, STACK_TEXT_LEN);
+    }
+    SLOT_END_WRITE(slot);
+
+    if (xid_stack)
+        pfree(xid_stack);
+    if (xmin_stack)
+        pfree(xmin_stack);
+}
+
+
+// Конец транзакции: xid и снимки отпущены
+static void
+pg_query_stack_horizon_reset(void)
+{
+    QueryStackBackendSlot *slot = MySlot;
+
+    if (slot == NULL || (slot->xid == InvalidTransactionId && slot->xmin == InvalidTransactionId))
+        return;
+
+    SLOT_BEGIN_WRITE(slot);
+    slot->xid = InvalidTransactionId;
+    slot->xmin = InvalidTransactionId;
+    SLOT_END_WRITE(slot);
+}
+
+
+/*
+    Может ли текущий пользователь видеть тексты запросов чужих сессий в общих агрегатах.
+    Та же граница, что у pg_stat_activity: суперпользователь и члены pg_read_all_stats.
+    Агрегаты собраны по всем пользователям и базам, поэтому остальным тексты и стеки отдаются как NULL, а числа - как есть.
+*/
+static bool
+pg_query_stack_can_read_texts(void)
+{
+    return has_privs_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS);
+}
+
+
+// Проверка, что расширение загружено через shared_preload_libraries (для функций, работающих с общей памятью)
+static void
+pg_query_stack_require_shmem(const char *funcname)
+{
+    if (SharedState == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("%s requires pg_query_stack to be loaded via shared_preload_libraries", funcname)));
+}
+
+
+/*
+    Запись добавления кадра в трассировку.
+    Добавление принимается, только если в буфере остаётся место под концы всех открытых кадров,
+    поэтому записанная трассировка всегда сбалансирована; не поместившиеся кадры только подсчитываются.
+*/
+static void
+pg_query_stack_trace_push(QueryStackEntry *entry)
+{
+    QueryStackTraceEvent *ev;
+    const char *src = entry->query_text;
+    int         i = 0;
+
+    entry->traced = false;
+
+    if (!TraceActive)
+        return;
+
+    if (TraceNEvents + TraceOpen + 2 > TraceMaxEvents)
+    {
+        TraceDropped++;
+        return;
+    }
+
+    ev = &TraceEvents[TraceNEvents++];
+    INSTR_TIME_SET_CURRENT(ev->time);
+    ev->text_hash = entry->text_hash;
+    ev->rows = 0;
+    ev->depth = entry->depth;
+    ev->phase = 'B';
+    ev->kind = (uint8) entry->kind;
+    ev->has_text = (src != NULL);
+    if (src != NULL)
+    {
+        for (; i < TRACE_TEXT_LEN - 1 && src[i] != '\0'; i++)
+            ev->text[i] = src[i];
+    }
+    ev->text[i] = '\0';
+
+    entry->traced = true;
+    TraceOpen++;
+}
+
+
+// Запись снятия кадра в трассировку (место под него зарезервировано при добавлении)
+static void
+pg_query_stack_trace_pop(QueryStackEntry *entry)
+{
+    QueryStackTraceEvent *ev;
+
+    if (!entry->traced)
+        return;
+
+    entry->traced = false;
+    TraceOpen--;
+
+    ev = &TraceEvents[TraceNEvents++];
+    INSTR_TIME_SET_CURRENT(ev->time);
+    ev->text_hash = entry->text_hash;
+    ev->rows = entry->rows;
+    ev->depth = entry->depth;
+    ev->phase = 'E';
+    ev->kind = (uint8) entry->kind;
+    ev->has_text = false;
+    ev->text[0] = '\0';
+}
+
+
+// Освобождение буфера трассировки
+static void
+pg_query_stack_trace_discard(void)
+{
+    ListCell   *lc;
+
+    foreach(lc, Query_Stack)
+        ((QueryStackEntry *) lfirst(lc))->traced = false;
+
+    if (TraceContext != NULL)
+    {
+        MemoryContextDelete(TraceContext);
+        TraceContext = NULL;
+    }
+
+    TraceEvents = NULL;
+    TraceActive = false;
+    TraceMaxEvents = 0;
+    TraceNEvents = 0;
+    TraceOpen = 0;
+    TraceDropped = 0;
+}
+
+
+/*
+    Остановка записи: закрываем ещё открытые кадры (в том числе кадр самого вызова pg_query_stack_trace_stop),
+    чтобы каждое начало кадра в трассировке имело свой конец.
+*/
+static void
+pg_query_stack_trace_finish(void)
+{
+    ListCell   *lc;
+
+    if (TraceEvents == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_query_stack trace is not running"),
+                 errhint("Start it with pg_query_stack_trace_start().")));
+
+    if (!TraceActive)
+        return;
+
+    // Query_Stack начинается с самого вложенного кадра - в этом же порядке кадры и закрываются
+    foreach(lc, Query_Stack)
+        pg_query_stack_trace_pop((QueryStackEntry *) lfirst(lc));
+
+    TraceActive = false;
+}
+
+
+// JSON одного события в формате Chrome trace event: пары B/E по одному потоку образуют дерево вложенных кадров
+static void
+pg_query_stack_trace_append_event(StringInfo buf, QueryStackTraceEvent *ev)
+{
+    instr_time  offset = ev->time;
+
+    INSTR_TIME_SUBTRACT(offset, TraceStartTime);
+
+    appendStringInfo(buf, "{\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+                     ev->phase, INSTR_TIME_GET_DOUBLE(offset) * 1000000.0, MyProcPid, MyProcPid);
+
+    if (ev->phase == 'B')
+    {
+        StringInfoData label;
+
+        initStringInfo(&label);
+        if (ev->has_text)
+        {
+            // Текст мог быть обрезан посреди многобайтового символа - отрезаем неполный символ
+            int         len = strlen(ev->text);
+
+            len = pg_mbcliplen(ev->text, len, len);
+            ev->text[len] = '\0';
+            pg_query_stack_append_frame_label(&label, ev->text);
+        }
+        else
+            pg_query_stack_append_frame_label(&label, NULL);
+
+        appendStringInfoString(buf, ",\"name\":");
+        escape_json(buf, label.data);
+        appendStringInfo(buf, ",\"cat\":\"%s\",\"args\":{\"depth\":%d,\"text_hash\":\"" INT64_FORMAT "\"}}",
+                         QueryStackFrameKindNames[ev->kind], ev->depth, (int64) ev->text_hash);
+        pfree(label.data);
+    }
+    else
+        appendStringInfo(buf, ",\"args\":{\"rows\":" UINT64_FORMAT "}}", ev->rows);
+}
+
+
+static void
+pg_query_stack_trace_append_header(StringInfo buf)
+{
+    appendStringInfoString(buf, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+}
+
+
+static void
+pg_query_stack_trace_append_footer(StringInfo buf)
+{
+    appendStringInfo(buf, "],\"otherData\":{\"dropped_frames\":\"" INT64_FORMAT "\"}}", TraceDropped);
+}
+
+
+/*
+    Сообщаем в pg_stat_activity queryId самого вложенного кадра, у которого он вычислен.
+    Вызывается после добавления и снятия кадров, так что при снятии возвращается queryId родителя.
+    Когда стек пуст, ничего не делаем: queryId запроса верхнего уровня ведёт сам Postgres.
+*/
+static void
+pg_query_stack_report_query_id(void)
+{
+    ListCell   *lc;
+
+    if (!report_query_id)
+        return;
+
+    foreach(lc, Query_Stack)
+    {
+        QueryStackEntry *entry = (QueryStackEntry *) lfirst(lc);
+
+        if (entry->query_id != UINT64CONST(0))
+        {
+            if (pgstat_get_my_query_id() != entry->query_id)
+                pgstat_report_query_id(entry->query_id, true);
+            return;
+        }
+    }
+}
+
+
+/*
+    Выполнение запроса плана, оставленного другим backend-ом в нашем слоте (pg_query_stack_explain).
+    В ванильном Postgres нет хука в CHECK_FOR_INTERRUPTS, поэтому запрос обслуживается в безопасных точках:
+    при добавлении и снятии кадров и в начале каждого оператора PL/pgSQL. Пока запроса нет, стоимость - одно чтение атомарной переменной.
+    План строится по живому QueryDesc кадра (как в auto_explain) и пишется в журнал сервера.
+    Запрос приходит от чужой сессии, поэтому ошибка построения плана не должна прерывать транзакцию этого backend-а:
+    план строится во внутренней подтранзакции, ошибка пишется в журнал с уровнем LOG и гасится.
+    Отмену запроса (statement_timeout, pg_cancel_backend) и завершение работы не гасим, как и WHEN OTHERS в PL/pgSQL:
+    они относятся к запросу пользователя, а не к построению плана.
+*/
+static void
+pg_query_stack_service_requests(void)
+{
+    static bool in_service = false;
+    uint64      request;
+    int         requester;
+    uint32      frame_code;
+    QueryStackEntry *target = NULL;
+    ListCell   *lc;
+    MemoryContext oldcontext = CurrentMemoryContext;
+    ResourceOwner oldowner = CurrentResourceOwner;
+    MemoryContext explain_context;
+
+    if (MySlot == NULL || pg_atomic_read_u64(&MySlot->explain_request) == 0)
+        return;
+
+    // Строить план можно только в нормальном состоянии транзакции; в параллельном режиме подтранзакцию не начать - ждём его конца
+    if (in_service || !IsTransactionState() || IsInParallelMode())
+        return;
+
+    request = pg_atomic_exchange_u64(&MySlot->explain_request, 0);
+    if (request == 0)
+        return;
+
+    requester = (int) (request >> 32);
+    frame_code = (uint32) request;
+
+    // Нужен кадр, уже прошедший ExecutorStart (у только что добавляемого кадра дерева состояний ещё нет)
+    foreach(lc, Query_Stack)
+    {
+        QueryStackEntry *entry = (QueryStackEntry *) lfirst(lc);
+
+        if (entry->query_desc->planstate == NULL)
+            continue;
+
+        if (frame_code == EXPLAIN_INNERMOST_FRAME || (uint32) entry->depth + 1 == frame_code)
+        {
+            target = entry;
+            break;
+        }
+    }
+
+    if (target == NULL)
+    {
+        ereport(LOG,
+                (errmsg("pg_query_stack: plan requested by backend %d is not available: frame is not running",
+                        requester),
+                 errhidestmt(true),
+                 errhidecontext(true)));
+        return;
+    }
+
+    // ExplainState и текст плана живут только до записи в журнал
+    explain_context = AllocSetContextCreate(oldcontext, "pg_query_stack explain", ALLOCSET_DEFAULT_SIZES);
+
+    in_service = true;
+    BeginInternalSubTransaction(NULL);
+    MemoryContextSwitchTo(explain_context);
+
+    PG_TRY();
+    {
+        ExplainState *es = NewExplainState();
+
+        es->format = EXPLAIN_FORMAT_TEXT;
+        es->verbose = true;
+        es->settings = true;
+
+        ExplainBeginOutput(es);
+        ExplainQueryText(es, target->query_desc);
+        ExplainQueryParameters(es, target->query_desc->params, -1);
+        ExplainPrintPlan(es, target->query_desc);
+        ExplainEndOutput(es);
+
+        if (es->str->len > 0 && es->str->data[es->str->len - 1] == '\n')
+            es->str->data[--es->str->len] = '\0';
+
+        ereport(LOG,
+                (errmsg("pg_query_stack: plan of frame %d requested by backend %d:\n%s",
+                        target->depth, requester, es->str->data),
+                 errhidestmt(true),
+                 errhidecontext(true)));
+
+        ReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(oldcontext);
+        CurrentResourceOwner = oldowner;
+    }
+    PG_CATCH();
+    {
+        ErrorData  *edata;
+
+        MemoryContextSwitchTo(oldcontext);
+        edata = CopyErrorData();
+        FlushErrorState();
+
+        RollbackAndReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(oldcontext);
+        CurrentResourceOwner = oldowner;
+
+        if (edata->sqlerrcode == ERRCODE_QUERY_CANCELED || edata->sqlerrcode == ERRCODE_ADMIN_SHUTDOWN)
+        {
+            MemoryContextDelete(explain_context);
+            in_service = false;
+            ReThrowError(edata);
+        }
+
+        ereport(LOG,
+                (errmsg("pg_query_stack: could not build plan of frame %d requested by backend %d: %s",
+                        target->depth, requester, edata->message),
+                 errhidestmt(true),
+                 errhidecontext(true)));
+        FreeErrorData(edata);
+    }
+    PG_END_TRY();
+
+    MemoryContextDelete(explain_context);
+    in_service = false;
+}
+
+
+/*
+    Обёртка ExecProcNode узлов кадра (pg_query_stack.explain_node_poll): безопасная точка для запроса плана на каждой строке.
+    Подменяет ExecProcNodeFirst из execProcnode.c, поэтому повторяет его работу: проверку глубины стека и учёт в instrument.
+*/
+static TupleTableSlot *
+pg_query_stack_ExecProcNode(PlanState *node)
+{
+    TupleTableSlot *result;
+
+    if (pg_atomic_read_u64(&MySlot->explain_request) != 0)
+        pg_query_stack_service_requests();
+
+    check_stack_depth();
+
+    if (node->instrument == NULL)
+        return node->ExecProcNodeReal(node);
+
+    InstrStartNode(node->instrument);
+    result = node->ExecProcNodeReal(node);
+    InstrStopNode(node->instrument, TupIsNull(result) ? 0.0 : 1.0);
+
+    return result;
+}
+
+
+// Подмена ExecProcNode во всём дереве состояний кадра (включая initPlan и subPlan); вызывается сразу после ExecutorStart
+static bool
+pg_query_stack_wrap_nodes(PlanState *planstate, void *context)
+{
+    if (planstate == NULL)
+        return false;
+
+    planstate->ExecProcNode = pg_query_stack_ExecProcNode;
+
+    return planstate_tree_walker(planstate, pg_query_stack_wrap_nodes, context);
+}
+
+
+// Учёт завершившегося вложенного кадра объясняемого запроса
+static void
+pg_query_stack_nested_account(QueryStackEntry *entry)
+{
+    QueryStackNestedEntry *nentry;
+    bool        found;
+
+    nentry = (QueryStackNestedEntry *) hash_search(NestedProfile, &entry->path_hash, HASH_ENTER, &found);
+
+    if (!found)
+    {
+        nentry->parent_path_hash = entry->parent ? entry->parent->path_hash : 0;
+        nentry->seq = hash_get_num_entries(NestedProfile);
+        nentry->query_text = entry->query_text ?
+            pg_query_stack_clip_text(NestedContext, entry->query_text, STACK_TEXT_LEN) : NULL;
+        nentry->calls = 0;
+        nentry->total_time = 0.0;
+        nentry->rows = 0;
+    }
+
+    nentry->calls++;
+    nentry->total_time += pg_query_stack_frame_elapsed(entry);
+    nentry->rows += entry->rows;
+}
+
+
+static int
+pg_query_stack_nested_cmp(const ListCell *a, const ListCell *b)
+{
+    int         seq_a = ((QueryStackNestedEntry *) lfirst(a))->seq;
+    int         seq_b = ((QueryStackNestedEntry *) lfirst(b))->seq;
+
+    return (seq_a > seq_b) - (seq_a < seq_b);
+}
+
+
+// Вывод поддерева вложенных запросов под путём parent (в порядке первого выполнения)
+static void
+pg_query_stack_nested_print(ReturnSetInfo *rsinfo, List *entries, uint64 parent, int level)
+{
+    ListCell   *lc;
+
+    foreach(lc, entries)
+    {
+        QueryStackNestedEntry *nentry = (QueryStackNestedEntry *) lfirst(lc);
+        StringInfoData line;
+        Datum       value;
+        bool        isnull = false;
+
+        if (nentry->parent_path_hash != parent || nentry->path_hash == parent)
+            continue;
+
+        initStringInfo(&line);
+        appendStringInfoSpaces(&line, level * 6);
+        appendStringInfoString(&line, "->  ");
+        pg_query_stack_append_frame_label(&line, nentry->query_text);
+        appendStringInfo(&line, "  (calls=" INT64_FORMAT " time=%.3f ms rows=" INT64_FORMAT ")",
+                         nentry->calls, nentry->total_time, nentry->rows);
+
+        value = CStringGetTextDatum(line.data);
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, &value, &isnull);
+        pfree(line.data);
+
+        pg_query_stack_nested_print(rsinfo, entries, nentry->path_hash, level + 1);
+    }
+}
+
+
+/*
+    Обработчик таймера сэмплирования. Вызывается из обработчика сигнала SIGALRM:
+    никаких выделений памяти и вызовов, только линейное пробирование заранее выделенной таблицы.
+*/
+static void
+pg_query_stack_sample_handler(void)
+{
+    uint64      path = SampleCurrentPath;
+    uint32      mask = SampleSize - 1;
+    uint32      i;
+
+    SampleTotal++;
+
+    if (path == 0 || SampleSlots == NULL)
+        return;
+
+    // Заполнение таблицы не больше половины, поэтому свободный слот на пути пробирования всегда найдётся
+    for (i = (uint32) path & mask;; i = (i + 1) & mask)
+    {
+        if (SampleSlots[i].path_hash == path)
+        {
+            SampleSlots[i].samples++;
+            return;
+        }
+
+        if (SampleSlots[i].path_hash == 0)
+        {
+            if (SampleUsed >= SampleMaxPaths)
+            {
+                SampleDropped++;
+                return;
+            }
+
+            SampleSlots[i].samples = 1;
+            SampleSlots[i].path_hash = path;
+            SampleUsed++;
+            return;
+        }
+    }
+}
+
+
+// Путь вызовов верхнего кадра для обработчика таймера (вызывается при каждом изменении стека)
+static void
+pg_query_stack_sample_sync(void)
+{
+    SampleCurrentPath = (Query_Stack != NIL) ? ((QueryStackEntry *) linitial(Query_Stack))->path_hash : 0;
+}
+
+
+// Подписи кадров от верхнего уровня до frame через ';' (сами ';' в подписях заменяем, они разделители свёрнутого стека)
+static void
+pg_query_stack_sample_append_frames(StringInfo buf, QueryStackEntry *frame)
+{
+    int         start;
+    int         i;
+
+    if (frame->parent != NULL)
+    {
+        pg_query_stack_sample_append_frames(buf, frame->parent);
+        appendStringInfoChar(buf, ';');
+    }
+
+    start = buf->len;
+    pg_query_stack_append_frame_label(buf, frame->query_text);
+    for (i = start; i < buf->len; i++)
+    {
+        if (buf->data[i] == ';')
+            buf->data[i] = ',';
+    }
+}
+
+
+// Запоминаем текст пути кадра для отчёта сэмплирования (один раз на путь)
+static void
+pg_query_stack_sample_register(QueryStackEntry *entry)
+{
+    QueryStackSamplePath *path;
+    bool        found;
+
+    path = (QueryStackSamplePath *) hash_search(SamplePaths, &entry->path_hash, HASH_ENTER, &found);
+
+    if (!found)
+    {
+        MemoryContext oldcontext = MemoryContextSwitchTo(SampleContext);
+        StringInfoData buf;
+
+        initStringInfo(&buf);
+        pg_query_stack_sample_append_frames(&buf, entry);
+        path->stack = buf.data;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+}
+
+
+// Таймер сэмплирования с периодом SampleInterval
+static void
+pg_query_stack_sample_enable(void)
+{
+    enable_timeout_every(SampleTimeoutId,
+                         TimestampTzPlusMilliseconds(GetCurrentTimestamp(), SampleInterval),
+                         SampleInterval);
+}
+
+
+// Добавление кадра: новый путь для обработчика таймера и, пока идёт сэмплирование, его текст для отчёта
+static void
+pg_query_stack_sample_push(QueryStackEntry *entry)
+{
+    if (SampleActive)
+    {
+        pg_query_stack_sample_register(entry);
+
+        // После ошибки Postgres снимает все таймеры сессии (disable_all_timeouts), поэтому взводим заново
+        if (!get_timeout_active(SampleTimeoutId))
+            pg_query_stack_sample_enable();
+    }
+
+    SampleCurrentPath = entry->path_hash;
+}
+
+
+// Остановка таймера и освобождение собранного профиля
+static void
+pg_query_stack_sample_discard(void)
+{
+    if (SampleTimeoutId != MAX_TIMEOUTS && get_timeout_active(SampleTimeoutId))
+        disable_timeout(SampleTimeoutId, false);
+    SampleActive = false;
+
+    // Таймер уже снят, поэтому обработчик больше не обратится к таблице
+    SampleSlots = NULL;
+    SamplePaths = NULL;
+    if (SampleContext != NULL)
+    {
+        MemoryContextDelete(SampleContext);
+        SampleContext = NULL;
+    }
+}
+
+
+// Запоминаем кадр изменяющего запроса под номером команды, которым помечаются записанные им строки
+static void
+pg_query_stack_register_origin(CommandId cid, QueryStackEntry *entry)
+{
+    QueryStackOriginEntry *origin;
+    bool        found;
+
+    if (TriggerOrigins == NULL)
+    {
+        HASHCTL     ctl;
+
+        ctl.keysize = sizeof(CommandId);
+        ctl.entrysize = sizeof(QueryStackOriginEntry);
+        ctl.hcxt = pg_query_stack_get_context();
+        TriggerOrigins = hash_create("pg_query_stack trigger origins", 16, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    origin = (QueryStackOriginEntry *) hash_search(TriggerOrigins, &cid, HASH_ENTER, &found);
+    origin->frame = entry;
+}
+
+
+/*
+    Кадр, поставивший в очередь событие строчного AFTER-триггера (NULL - неизвестен).
+    Номер команды берём из строки события: для вставки и обновления - cmin новой версии, для удаления - cmax старой.
+    Номер команды осмыслен только для строк, изменённых текущей транзакцией, это проверяем до его чтения.
+*/
+static QueryStackEntry *
+pg_query_stack_trigger_origin(TriggerData *trigdata)
+{
+    HeapTuple   tuple;
+    HeapTupleHeader tup;
+    CommandId   cid;
+    QueryStackOriginEntry *origin;
+
+    if (TriggerOrigins == NULL ||
+        !TRIGGER_FIRED_AFTER(trigdata->tg_event) || !TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+        return NULL;
+
+    tuple = TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) ? trigdata->tg_newtuple : trigdata->tg_trigtuple;
+    if (tuple == NULL || tuple->t_data == NULL)
+        return NULL;
+    tup = tuple->t_data;
+
+    if (TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+    {
+        if ((tup->t_infomask & HEAP_XMAX_IS_MULTI) ||
+            !TransactionIdIsCurrentTransactionId(HeapTupleHeaderGetRawXmax(tup)))
+            return NULL;
+        cid = HeapTupleHeaderGetCmax(tup);
+    }
+    else
+    {
+        if (!TransactionIdIsCurrentTransactionId(HeapTupleHeaderGetRawXmin(tup)))
+            return NULL;
+        cid = HeapTupleHeaderGetCmin(tup);
+    }
+
+    origin = (QueryStackOriginEntry *) hash_search(TriggerOrigins, &cid, HASH_FIND, NULL);
+
+    return origin ? origin->frame : NULL;
+}
+
+
+/*
+    Кадры стека для вывода (самый вложенный первый).
+    Под кадром триггера с известным источником вместо текущих кадров идёт цепочка кадра-источника:
+    отложенный триггер срабатывает на COMMIT, когда на стеке уже нет запроса, изменившего строку.
+*/
+static List *
+pg_query_stack_origin_frames(void)
+{
+    List       *frames = NIL;
+    ListCell   *lc;
+
+    foreach(lc, Query_Stack)
+    {
+        QueryStackEntry *entry = (QueryStackEntry *) lfirst(lc);
+
+        frames = lappend(frames, entry);
+
+        if (entry->origin != NULL)
+        {
+            // Источник и его родители добавлены раньше кадра триггера, поэтому цепочка всегда конечна
+            for (entry = entry->origin; entry != NULL; entry = entry->origin ? entry->origin : entry->parent)
+                frames = lappend(frames, entry);
+            break;
+        }
+    }
+
+    return frames;
+}
+
+
+// Вызов PL/pgSQL, из тела которого пришёл добавляемый сейчас запрос (NULL если запрос не из PL/pgSQL)
+static QueryStackPLCall *
+pg_query_stack_current_pl_call(void)
+{
+    QueryStackPLCall *call;
+
+    if (PL_Call_Stack == NIL)
+        return NULL;
+
+    call = (QueryStackPLCall *) linitial(PL_Call_Stack);
+
+    // Запросы самой функции идут на той глубине, что была при входе в неё. Более глубокие - уже не её.
+    return (call->frame_depth == Query_Stack_Depth) ? call : NULL;
+}
+
+
+/*
+    Сжатие повторяющихся циклов кадров (рекурсия A -> B -> A -> B ...) для вывода.
+    Один проход по хэшам текстов от верхнего кадра к нижнему: в каждой позиции ищем цикл длиной до MAX_CYCLE_LENGTH,
+    который повторяется подряд, и оставляем только первое его вхождение с количеством повторов в repeat_count.
+    Длина цикла ограничена константой, поэтому проход остаётся линейным по глубине стека.
+*/
+#define MAX_CYCLE_LENGTH 16
+
+static List *
+pg_query_stack_collapse_cycles(List *frames)
+{
+    int         n = list_length(frames);
+    QueryStackEntry **arr;
+    List       *result = NIL;
+    int         i = 0;
+
+    if (n == 0)
+        return NIL;
+
+    arr = (QueryStackEntry **) palloc(n * sizeof(QueryStackEntry *));
+    for (i = 0; i < n; i++)
+        arr[i] = (QueryStackEntry *) list_nth(frames, i);
+
+    i = 0;
+    while (i < n)
+    {
+        int         best_len = 0;
+        int         best_reps = 1;
+        int         len;
+        int         k;
+
+        for (len = 1; len <= MAX_CYCLE_LENGTH && i + 2 * len <= n; len++)
+        {
+            int         reps = 1;
+
+            // Считаем, сколько раз подряд повторяется блок arr[i .. i+len-1]
+            while (i + (reps + 1) * len <= n)
+            {
+                for (k = 0; k < len; k++)
+                {
+                    if (arr[i + k]->text_hash != arr[i + reps * len + k]->text_hash)
+                        break;
+                }
+
+                if (k < len)
+                    break;
+
+                reps++;
+            }
+
+            // Берём цикл, который покрывает больше всего кадров
+            if (reps > 1 && reps * len > best_reps * best_len)
+            {
+                best_len = len;
+                best_reps = reps;
+            }
+        }
+
+        if (best_len == 0)
+        {
+            arr[i]->repeat_count = 1;
+            result = lappend(result, arr[i]);
+            i++;
+            continue;
+        }
+
+        for (k = 0; k < best_len; k++)
+        {
+            arr[i + k]->repeat_count = best_reps;
+            result = lappend(result, arr[i + k]);
+        }
+
+        i += best_len * best_reps;
+    }
+
+    pfree(arr);
+
+    return result;
+}
+
+
+// Вид кадра по имени (для аргумента _frame_kind)
+static QueryStackFrameKind
+pg_query_stack_kind_from_name(const char *name)
+{
+    int         i;
+
+    for (i = 0; i < QSK_COUNT; i++)
+    {
+        if (pg_strcasecmp(name, QueryStackFrameKindNames[i]) == 0)
+            return (QueryStackFrameKind) i;
+    }
+
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("unknown frame kind \"%s\"", name),
+             errhint("Valid frame kinds are: toplevel, nested, trigger, sql_function, spi, cursor.")));
+
+    return QSK_NESTED;          // чтобы компилятор не ругался
+}
+
+
+// Загрузка расширения в память
+void
+_PG_init(void)
+{
+    // Регистрируем хуки (сохраняя прошлые)
+    prev_ExecutorStart = ExecutorStart_hook;
+    ExecutorStart_hook = pg_query_stack_ExecutorStart;
+    prev_ExecutorRun = ExecutorRun_hook;
+    ExecutorRun_hook = pg_query_stack_ExecutorRun;
+    prev_ExecutorEnd = ExecutorEnd_hook;
+    ExecutorEnd_hook = pg_query_stack_ExecutorEnd;
+    prev_planner_hook = planner_hook;
+    planner_hook = pg_query_stack_planner;
+    
+    // Регистрируем callback транзакции и подтранзакции
+    RegisterXactCallback(pg_query_stack_xact_callback, NULL);
+    RegisterSubXactCallback(pg_query_stack_subxact_callback, NULL);
+
+    // Регистрируем плагин PL/pgSQL (сохраняя прошлый)
+    plpgsql_plugin_ptr = (PLpgSQL_plugin **) find_rendezvous_variable("PLpgSQL_plugin");
+    prev_plpgsql_plugin = *plpgsql_plugin_ptr;
+    *plpgsql_plugin_ptr = &pg_query_stack_plpgsql_plugin;
+
+    // Параметры области полного захвата кадров
+    DefineCustomStringVariable("pg_query_stack.capture_functions",
+                               "Functions under which stack frames are captured in full.",
+                               "Comma-separated list of function names, optionally schema-qualified. "
+                               "Frames outside the capture scope are recorded as depth markers without query text.",
+                               &capture_functions_string,
+                               "",
+                               PGC_USERSET,
+                               GUC_LIST_INPUT,
+                               pg_query_stack_capture_functions_check,
+                               pg_query_stack_capture_functions_assign,
+                               NULL);
+
+    DefineCustomStringVariable("pg_query_stack.overrides",
+                               "Settings overridden for statements under selected call paths.",
+                               "Semicolon-separated rules of the form \"outer_function > inner_function: name=value, ...\".",
+                               &overrides_string,
+                               "",
+                               PGC_SUSET,
+                               0,
+                               pg_query_stack_overrides_check,
+                               pg_query_stack_overrides_assign,
+                               NULL);
+
+    DefineCustomIntVariable("pg_query_stack.capture_max_depth",
+                            "Number of top stack levels that are always captured in full.",
+                            "0 means no depth limit.",
+                            &capture_max_depth,
+                            0,
+                            0, INT_MAX,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomBoolVariable("pg_query_stack.track_profile",
+                             "Collects the per-session call-path profile.",
+                             "Measures each frame and aggregates it by call path and plan shape.",
+                             &track_profile,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomIntVariable("pg_query_stack.profile_max",
+                            "Maximum number of entries in the per-session call-path profile.",
+                            NULL,
+                            &profile_max,
+                            5000,
+                            100, INT_MAX / 2,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomBoolVariable("pg_query_stack.report_query_id",
+                             "Reports the query identifier of the innermost stack frame in pg_stat_activity.",
+                             "Requires query identifiers to be computed (see compute_query_id).",
+                             &report_query_id,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    /*
+        Общая память доступна только при загрузке через shared_preload_libraries.
+        При загрузке через session_preload_libraries работает только то, что не выходит за пределы сессии.
+    */
+    if (process_shared_preload_libraries_in_progress)
+    {
+        DefineCustomIntVariable("pg_query_stack.writers_max",
+                                "Maximum number of entries in the shared table-writers index.",
+                                NULL,
+                                &writers_max,
+                                10000,
+                                100, INT_MAX / 2,
+                                PGC_POSTMASTER,
+                                0,
+                                NULL,
+                                NULL,
+                                NULL);
+
+        DefineCustomBoolVariable("pg_query_stack.track_writes",
+                                 "Collects which call paths write to each table.",
+                                 NULL,
+                                 &track_writes,
+                                 true,
+                                 PGC_SUSET,
+                                 0,
+                                 NULL,
+                                 NULL,
+                                 NULL);
+
+        DefineCustomBoolVariable("pg_query_stack.explain_node_poll",
+                                 "Checks for plan requests from pg_query_stack_explain() on every row of every plan node.",
+                                 "Lets a long-running plan node answer without waiting for the next frame push or pop.",
+                                 &explain_node_poll,
+                                 false,
+                                 PGC_SUSET,
+                                 0,
+                                 NULL,
+                                 NULL,
+                                 NULL);
+
+        DefineCustomBoolVariable("pg_query_stack.track_horizon",
+                                 "Publishes which call paths assigned the transaction ID and took the oldest snapshot of each backend.",
+                                 NULL,
+                                 &track_horizon,
+                                 true,
+                                 PGC_SUSET,
+                                 0,
+                                 NULL,
+                                 NULL,
+                                 NULL);
+
+        DefineCustomIntVariable("pg_query_stack.shared_profile_max",
+                                "Maximum number of entries in the shared call-path profile.",
+                                NULL,
+                                &shared_profile_max,
+                                5000,
+                                100, INT_MAX / 2,
+                                PGC_POSTMASTER,
+                                0,
+                                NULL,
+                                NULL,
+                                NULL);
+
+        DefineCustomIntVariable("pg_query_stack.window_count",
+                                "Number of time windows kept in the shared windowed profile.",
+                                NULL,
+                                &window_count,
+                                60,
+                                1, 10080,
+                                PGC_POSTMASTER,
+                                0,
+                                NULL,
+                                NULL,
+                                NULL);
+
+        DefineCustomIntVariable("pg_query_stack.window_seconds",
+                                "Length of one time window of the shared windowed profile.",
+                                NULL,
+                                &window_seconds,
+                                60,
+                                1, 86400,
+                                PGC_POSTMASTER,
+                                GUC_UNIT_S,
+                                NULL,
+                                NULL,
+                                NULL);
+
+        DefineCustomIntVariable("pg_query_stack.window_entries",
+                                "Maximum number of call paths in one time window of the shared windowed profile.",
+                                NULL,
+                                &window_entries,
+                                1000,
+                                16, 1000000,
+                                PGC_POSTMASTER,
+                                0,
+                                NULL,
+                                NULL,
+                                NULL);
+
+        DefineCustomIntVariable("pg_query_stack.publish_depth",
+                                "Number of top stack frames each backend publishes in shared memory.",
+                                NULL,
+                                &publish_depth,
+                                16,
+                                1, 1024,
+                                PGC_POSTMASTER,
+                                0,
+                                NULL,
+                                NULL,
+                                NULL);
+
+        prev_shmem_request_hook = shmem_request_hook;
+        shmem_request_hook = pg_query_stack_shmem_request;
+        prev_shmem_startup_hook = shmem_startup_hook;
+        shmem_startup_hook = pg_query_stack_shmem_startup;
+    }
+
+    MarkGUCPrefixReserved("pg_query_stack");
+}
+
+
+// Выгрузка расширения из памяти
+void
+_PG_fini(void)
+{
+    // Восстанавливаем прошлые хуки
+    ExecutorStart_hook = prev_ExecutorStart;
+    ExecutorRun_hook = prev_ExecutorRun;
+    ExecutorEnd_hook = prev_ExecutorEnd;
+    planner_hook = prev_planner_hook;
+    shmem_request_hook = prev_shmem_request_hook;
+    shmem_startup_hook = prev_shmem_startup_hook;
+    
+    // Снимаем регистрацию callback транзакции и подтранзакции
+    UnregisterXactCallback(pg_query_stack_xact_callback, NULL);
+    UnregisterSubXactCallback(pg_query_stack_subxact_callback, NULL);
+
+    // Возвращаем прошлый плагин PL/pgSQL
+    if (plpgsql_plugin_ptr != NULL)
+        *plpgsql_plugin_ptr = prev_plpgsql_plugin;
+}
+
+/* 
+    Функция обратного вызова транзакции
+    Зачем он нам нужен? 
+    Дело в том, что есть случаи когда у нас НЕ вызывается End хук и стек остается не очищенным.
+    Это такие случаи, когда например во вложенном вызове происходит ошибка на этапе разбора плана (не нашлась таблица, функция, колонка).
+    В этом случае происходит мгновенный выход из транзакции и не вызываются End хуки головного запроса и так далее по цепочке выше.
+    В этих случаях мы перехватываем callback транзакции и очищаем ВЕСЬ стек вручную. 
+*/
+static void
+pg_query_stack_xact_callback(XactEvent event, void *arg)
+{
+    if (event == XACT_EVENT_ABORT || event == XACT_EVENT_COMMIT)
+    {
+        // Записи зафиксированной транзакции переносим в общий обратный индекс
+        if (event == XACT_EVENT_COMMIT)
+            pg_query_stack_flush_writes();
+        PendingWrites = NULL;
+
+        // Профиль транзакции переносим в общий в любом случае: время выполнения было потрачено и при откате
+        pg_query_stack_flush_profile();
+        PendingProfile = NULL;
+
+        // Кадры, не дошедшие до ExecutorEnd, закрываем в трассировке до удаления их памяти
+        if (TraceActive)
+        {
+            ListCell   *lc;
+
+            foreach(lc, Query_Stack)
+                pg_query_stack_trace_pop((QueryStackEntry *) lfirst(lc));
+        }
+
+        if (QueryStackContext != NULL)
+        {
+            MemoryContextDelete(QueryStackContext);
+            QueryStackContext = NULL;
+        }
+
+        Query_Stack = NIL;
+        Query_Stack_Depth = 0;
+        PL_Call_Stack = NIL;
+        TriggerOrigins = NULL;
+        pg_query_stack_publish_pop(false);
+        pg_query_stack_horizon_reset();
+        pg_query_stack_sample_sync();
+    }
+}
+
+
+/*
+    Функция обратного вызова подтранзакции.
+    При ошибке внутри блока BEGIN ... EXCEPTION в PL/pgSQL откатывается только подтранзакция, транзакция продолжается.
+    Хуки ExecutorEnd упавших запросов и func_end упавших функций при этом не вызываются,
+    поэтому снимаем со стека всё, что было добавлено в откатываемой подтранзакции (и в её дочерних - их номера больше).
+    Такие кадры не обязательно лежат на вершине: кадр курсора, открытого в откатываемой подтранзакции,
+    может оказаться под кадрами, пережившими откат, поэтому проходим весь стек.
+*/
+static void
+pg_query_stack_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                                SubTransactionId parentSubid, void *arg)
+{
+    ListCell   *lc;
+    bool        kept_above = false;     // выше уже есть переживший откат кадр
+    bool        republish = false;
+
+    if (event != SUBXACT_EVENT_ABORT_SUB)
+        return;
+
+    foreach(lc, Query_Stack)
+    {
+        QueryStackEntry *entry = (QueryStackEntry *) lfirst(lc);
+
+        if (entry->subid >= mySubid)
+        {
+            // Кадр снимается не с вершины: опубликованные кадры над ним сдвигаются
+            if (kept_above)
+                republish = true;
+
+            pg_query_stack_trace_pop(entry);
+            Query_Stack = foreach_delete_current(Query_Stack, lc);
+            Query_Stack_Depth--;
+        }
+        else
+            kept_above = true;
+    }
+
+    pg_query_stack_publish_pop(republish);
+    pg_query_stack_report_query_id();
+    pg_query_stack_sample_sync();
+
+    pg_query_stack_discard_writes(mySubid);
+
+    foreach(lc, PL_Call_Stack)
+    {
+        QueryStackPLCall *call = (QueryStackPLCall *) lfirst(lc);
+
+        if (call->subid >= mySubid)
+            PL_Call_Stack = foreach_delete_current(PL_Call_Stack, lc);
+    }
+}
+
+
+/*
+    Функции плагина PL/pgSQL.
+    Поля error_callback, assign_expr и т.д. PL/pgSQL заполняет в нашей структуре перед вызовом func_setup,
+    поэтому перед вызовом предыдущего плагина копируем их и в него.
+*/
+static void
+pg_query_stack_plpgsql_func_setup(PLpgSQL_execstate *estate, PLpgSQL_function *func)
+{
+    if (prev_plpgsql_plugin)
+    {
+        prev_plpgsql_plugin->error_callback = pg_query_stack_plpgsql_plugin.error_callback;
+        prev_plpgsql_plugin->assign_expr = pg_query_stack_plpgsql_plugin.assign_expr;
+        prev_plpgsql_plugin->assign_value = pg_query_stack_plpgsql_plugin.assign_value;
+        prev_plpgsql_plugin->eval_datum = pg_query_stack_plpgsql_plugin.eval_datum;
+        prev_plpgsql_plugin->cast_value = pg_query_stack_plpgsql_plugin.cast_value;
+
+        if (prev_plpgsql_plugin->func_setup)
+            prev_plpgsql_plugin->func_setup(estate, func);
+    }
+}
+
+
+// Вход в функцию PL/pgSQL: запоминаем вызов и глубину стека, на которой пойдут её запросы
+static void
+pg_query_stack_plpgsql_func_beg(PLpgSQL_execstate *estate, PLpgSQL_function *func)
+{
+    if (TopTransactionContext != NULL)
+    {
+        MemoryContext oldcontext = MemoryContextSwitchTo(pg_query_stack_get_context());
+        QueryStackPLCall *call = (QueryStackPLCall *) palloc(sizeof(QueryStackPLCall));
+        QueryStackScopeCacheEntry *cache_entry = pg_query_stack_function_lookup(func->fn_oid);
+
+        call->estate = estate;
+        call->frame_depth = Query_Stack_Depth;
+        call->subid = GetCurrentSubTransactionId();
+        call->trigger_name = NULL;
+        call->trigger_relid = InvalidOid;
+        call->matched = cache_entry ? cache_entry->matched : false;
+        call->override_mask = cache_entry ? cache_entry->override_mask : 0;
+
+        // Первый вызов функции в сессии (прогрев) и время входа - только для профиля
+        call->first_call = false;
+        call->dynamic_stmt = NULL;
+        INSTR_TIME_SET_ZERO(call->start_time);
+        if (track_profile)
+        {
+            call->first_call = pg_query_stack_warmup_first_call(func);
+            INSTR_TIME_SET_CURRENT(call->start_time);
+        }
+
+        // Функция вызвана как DML-триггер: запоминаем имя триггера, таблицу и кадр, из-за которого он сработал
+        call->origin = NULL;
+        if (estate->trigdata != NULL)
+        {
+            call->trigger_name = pstrdup(estate->trigdata->tg_trigger->tgname);
+            call->trigger_relid = RelationGetRelid(estate->trigdata->tg_relation);
+            call->origin = pg_query_stack_trigger_origin(estate->trigdata);
+        }
+
+        PL_Call_Stack = lcons(call, PL_Call_Stack);
+
+        MemoryContextSwitchTo(oldcontext);
+
+        // Переопределения параметров по пути вызовов (до первого запроса функции, чтобы их увидел и планировщик)
+        pg_query_stack_apply_overrides(call);
+    }
+
+    if (prev_plpgsql_plugin && prev_plpgsql_plugin->func_beg)
+        prev_plpgsql_plugin->func_beg(estate, func);
+}
+
+
+/*
+    Выход из функции PL/pgSQL: убираем её запись и восстанавливаем переопределённые параметры.
+    При ошибке сюда не попадаем: записи чистят callback-и транзакций, уровни GUC откатывает сам Postgres.
+*/
+static void
+pg_query_stack_plpgsql_func_end(PLpgSQL_execstate *estate, PLpgSQL_function *func)
+{
+    ListCell   *lc;
+
+    foreach(lc, PL_Call_Stack)
+    {
+        QueryStackPLCall *call = (QueryStackPLCall *) lfirst(lc);
+
+        if (call->estate == estate)
+        {
+            if (call->guc_nestlevel > 0)
+                AtEOXact_GUC(true, call->guc_nestlevel);
+
+            if (!INSTR_TIME_IS_ZERO(call->start_time))
+                pg_query_stack_func_account(call, func);
+
+            PL_Call_Stack = foreach_delete_current(PL_Call_Stack, lc);
+            break;
+        }
+    }
+
+    if (prev_plpgsql_plugin && prev_plpgsql_plugin->func_end)
+        prev_plpgsql_plugin->func_end(estate, func);
+}
+
+
+// Оператор PL/pgSQL выполняет динамический SQL (текст запроса вычисляется при выполнении)
+static bool
+pg_query_stack_stmt_is_dynamic(PLpgSQL_stmt *stmt)
+{
+    switch (stmt->cmd_type)
+    {
+        case PLPGSQL_STMT_DYNEXECUTE:
+        case PLPGSQL_STMT_DYNFORS:
+            return true;
+        case PLPGSQL_STMT_OPEN:
+            return ((PLpgSQL_stmt_open *) stmt)->dynquery != NULL;
+        case PLPGSQL_STMT_RETURN_QUERY:
+            return ((PLpgSQL_stmt_return_query *) stmt)->dynquery != NULL;
+        default:
+            return false;
+    }
+}
+
+
+/*
+    Планирует ли планировщик одно из собственных выражений динамического оператора (строку запроса или аргумент USING).
+    Выражения вычисляются до планирования динамического запроса на той же глубине стека, а их текст PL/pgSQL
+    передаёт планировщику как есть, поэтому отличаем их по тексту.
+*/
+static bool
+pg_query_stack_stmt_own_expr(PLpgSQL_stmt *stmt, const char *query_string)
+{
+    PLpgSQL_expr *query = NULL;
+    List       *params = NIL;
+    ListCell   *lc;
+
+    if (query_string == NULL)
+        return false;
+
+    switch (stmt->cmd_type)
+    {
+        case PLPGSQL_STMT_DYNEXECUTE:
+            query = ((PLpgSQL_stmt_dynexecute *) stmt)->query;
+            params = ((PLpgSQL_stmt_dynexecute *) stmt)->params;
+            break;
+        case PLPGSQL_STMT_DYNFORS:
+            query = ((PLpgSQL_stmt_dynfors *) stmt)->query;
+            params = ((PLpgSQL_stmt_dynfors *) stmt)->params;
+            break;
+        case PLPGSQL_STMT_OPEN:
+            query = ((PLpgSQL_stmt_open *) stmt)->dynquery;
+            params = ((PLpgSQL_stmt_open *) stmt)->params;
+            break;
+        case PLPGSQL_STMT_RETURN_QUERY:
+            query = ((PLpgSQL_stmt_return_query *) stmt)->dynquery;
+            params = ((PLpgSQL_stmt_return_query *) stmt)->params;
+            break;
+        default:
+            return false;
+    }
+
+    if (query != NULL && query->query != NULL && strcmp(query->query, query_string) == 0)
+        return true;
+
+    foreach(lc, params)
+    {
+        PLpgSQL_expr *param = (PLpgSQL_expr *) lfirst(lc);
+
+        if (param->query != NULL && strcmp(param->query, query_string) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+
+/*
+    Хэш текста запроса без литералов: строковые и числовые константы заменяются на '?', пробельные символы схлопываются.
+    Нужен, когда queryId не вычисляется (compute_query_id = off), чтобы EXECUTE с разными литералами считались одним запросом.
+*/
+static uint64
+pg_query_stack_normalized_hash(const char *text)
+{
+    uint64      hash = 0;
+    unsigned char prev = ' ';       // последний учтённый символ
+    const char *p = text;
+
+    while (*p != '\0')
+    {
+        unsigned char c = (unsigned char) *p;
+
+        if (c == '\'')
+        {
+            // Строковая константа, '' внутри - экранированная кавычка
+            for (p++; *p != '\0'; p++)
+            {
+                if (*p == '\'')
+                {
+                    if (p[1] != '\'')
+                        break;
+                    p++;
+                }
+            }
+            if (*p != '\0')
+                p++;
+            c = '?';
+        }
+        else if (isdigit(c) && !(isalnum(prev) || prev == '_' || IS_HIGHBIT_SET(prev)))
+        {
+            // Числовая константа (цифры в середине идентификатора сюда не попадают)
+            while (isdigit((unsigned char) *p) || *p == '.')
+                p++;
+            c = '?';
+        }
+        else if (isspace(c))
+        {
+            while (isspace((unsigned char) *p))
+                p++;
+            c = ' ';
+        }
+        else
+            p++;
+
+        hash = hash_combine64(hash, (uint64) c);
+        prev = c;
+    }
+
+    return hash;
+}
+
+
+// Учёт планирования динамического запроса функции call
+static void
+pg_query_stack_dynamic_plan_account(QueryStackPLCall *call, Query *parse, const char *query_string, double plan_time)
+{
+    QueryStackEntry *caller = (Query_Stack != NIL) ? (QueryStackEntry *) linitial(Query_Stack) : NULL;
+    QueryStackDynamicPlanKey key;
+    QueryStackDynamicPlanEntry *dentry;
+    bool        found;
+
+    pg_query_stack_profile_init();
+
+    // Ключ сравнивается побайтно, поэтому обнуляем выравнивание
+    memset(&key, 0, sizeof(key));
+    key.caller_path_hash = caller ? caller->path_hash : 0;
+    if (parse->queryId != UINT64CONST(0))
+        key.query_hash = parse->queryId;
+    else
+        key.query_hash = query_string ? pg_query_stack_normalized_hash(query_string) : 0;
+    key.fn_oid = call->estate->func->fn_oid;
+
+    dentry = (QueryStackDynamicPlanEntry *) hash_search(DynamicPlanHash, &key, HASH_FIND, NULL);
+
+    if (dentry == NULL)
+    {
+        MemoryContext oldcontext;
+
+        // Таблица заполнена - новые запросы не добавляем, как и в профиле
+        if (hash_get_num_entries(DynamicPlanHash) >= profile_max)
+            return;
+
+        dentry = (QueryStackDynamicPlanEntry *) hash_search(DynamicPlanHash, &key, HASH_ENTER, &found);
+
+        oldcontext = MemoryContextSwitchTo(ProfileContext);
+        dentry->caller_stack = caller ? pg_query_stack_format_stack(caller, " > ", STACK_TEXT_LEN) : NULL;
+        MemoryContextSwitchTo(oldcontext);
+
+        dentry->query_text = query_string ?
+            pg_query_stack_clip_text(ProfileContext, query_string, PROFILE_TEXT_LEN) : NULL;
+        dentry->plans = 0;
+        dentry->plan_time = 0.0;
+    }
+
+    dentry->plans++;
+    dentry->plan_time += plan_time;
+}
+
+
+/*
+    Хук планировщика: измеряем только планирование динамического SQL функций PL/pgSQL (при track_profile).
+    Запрос функции планируется на той же глубине стека, что и её вызов, поэтому планирование запросов,
+    вложенных в выполнение динамического (их кадры глубже), сюда не попадает. Выражения самого оператора
+    (строка запроса, аргументы USING) планируются на той же глубине - их отсекаем по тексту.
+*/
+static PlannedStmt *
+pg_query_stack_planner(Query *parse, const char *query_string, int cursorOptions, ParamListInfo boundParams)
+{
+    QueryStackPLCall *call = track_profile ? pg_query_stack_current_pl_call() : NULL;
+    PlannedStmt *result;
+    instr_time  start_time;
+    instr_time  duration;
+
+    if (call == NULL || call->dynamic_stmt == NULL ||
+        pg_query_stack_stmt_own_expr(call->dynamic_stmt, query_string))
+    {
+        if (prev_planner_hook)
+            return prev_planner_hook(parse, query_string, cursorOptions, boundParams);
+        return standard_planner(parse, query_string, cursorOptions, boundParams);
+    }
+
+    INSTR_TIME_SET_CURRENT(start_time);
+
+    if (prev_planner_hook)
+        result = prev_planner_hook(parse, query_string, cursorOptions, boundParams);
+    else
+        result = standard_planner(parse, query_string, cursorOptions, boundParams);
+
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start_time);
+
+    pg_query_stack_dynamic_plan_account(call, parse, query_string, INSTR_TIME_GET_MILLISEC(duration));
+
+    return result;
+}
+
+
+/*
+    Начало оператора PL/pgSQL: безопасная точка для запроса плана (в циклах функций операторы идут постоянно).
+    Здесь же отмечаем операторы с динамическим SQL: его планирование идёт сразу после начала оператора,
+    а следующий оператор той же функции снимает отметку.
+*/
+static void
+pg_query_stack_plpgsql_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
+{
+    QueryStackPLCall *call = (PL_Call_Stack != NIL) ? (QueryStackPLCall *) linitial(PL_Call_Stack) : NULL;
+
+    if (call != NULL && call->estate == estate)
+        call->dynamic_stmt = pg_query_stack_stmt_is_dynamic(stmt) ? stmt : NULL;
+
+    pg_query_stack_service_requests();
+
+    if (prev_plpgsql_plugin && prev_plpgsql_plugin->stmt_beg)
+        prev_plpgsql_plugin->stmt_beg(estate, stmt);
+}
+
+
+/*
+Выполняем перехват запроса нашим хуком и записываем его в стек (список Query_Stack). 
+Почему именно ExecutorStart:
+    ExecutorStart: Вызывается в самом начале выполнения плана запроса, перед тем как будут обработаны какие-либо данные. 
+                   Он позволяет выполнить инициализацию или модификации перед началом фактического исполнения запроса, или запись в стек в нашем случае
+    ExecutorRun: Вызывается при фактическом выполнении плана, когда началось извлечение кортежей (строк данных). 
+                 Он может вызываться несколько раз в течение одного запроса, особенно если запрос выполняется в пакетном режиме или использует курсоры.
+             
+Именно поэтому нам подходит хук ExecutorStart.
+*/
+static void
+pg_query_stack_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+    MemoryContext oldcontext;
+
+    /*
+        Если по какой-то причине нам не доступен контекст транзакции - просто выходим.
+        Параллельный исполнитель выполняет часть плана лидера с тем же текстом запроса: его кадры - не отдельная работа,
+        они уже учтены в стеке лидера (иначе исполнители выглядели бы в общей памяти как одновременные копии запроса лидера).
+    */
+    if (TopTransactionContext == NULL || IsParallelWorker())
+    {
+        if (prev_ExecutorStart)
+            prev_ExecutorStart(queryDesc, eflags);
+        else
+            standard_ExecutorStart(queryDesc, eflags);
+            
+        return;
+    }
+    
+    // Перелючаем на собственный контекст (порождённый от TopTransactionContext)
+    oldcontext = MemoryContextSwitchTo(pg_query_stack_get_context());
+    
+    // Создаём новый элемент стека
+    QueryStackEntry *entry = (QueryStackEntry *) palloc(sizeof(QueryStackEntry));
+    // Вызов PL/pgSQL, из которого пришёл запрос (если есть)
+    QueryStackPLCall *pl_call = pg_query_stack_current_pl_call();
+
+    // Кадр, под которым добавляется новый (NULL - стек пуст)
+    QueryStackEntry *parent = (Query_Stack != NIL) ? (QueryStackEntry *) linitial(Query_Stack) : NULL;
+
+    /*
+        Область захвата: кадр внутри функции из capture_functions, если такая функция его выполняет или он лежит под таким кадром.
+        Кадры вне области (и глубже capture_max_depth) пишем как отметки глубины - без копирования текста.
+    */
+    entry->in_scope = (parent != NULL && parent->in_scope) || (pl_call != NULL && pl_call->matched);
+    entry->captured = !CaptureFiltersActive() ||
+                      entry->in_scope ||
+                      (capture_max_depth > 0 && Query_Stack_Depth < capture_max_depth);
+
+    // Копируем sourceText
+    if (!entry->captured)
+        entry->query_text = NULL;
+    else if (queryDesc->sourceText)
+        entry->query_text = pstrdup(queryDesc->sourceText);
+    else
+        entry->query_text = pstrdup("<unnamed query>");
+
+    entry->query_desc = queryDesc;
+    entry->subid = GetCurrentSubTransactionId();
+    entry->depth = Query_Stack_Depth;
+    entry->kind = pg_query_stack_classify(queryDesc, pl_call);
+    // Строка с именем триггера живёт в том же QueryStackContext, копировать её не нужно
+    entry->trigger_name = pl_call ? pl_call->trigger_name : NULL;
+    entry->trigger_relid = pl_call ? pl_call->trigger_relid : InvalidOid;
+    entry->origin = pl_call ? pl_call->origin : NULL;
+
+    // Хэш текста и пути вызовов считаем всегда (и для отметок глубины): путь должен оставаться непрерывным
+    entry->parent = parent;
+    if (queryDesc->sourceText)
+        entry->text_hash = hash_bytes_extended((const unsigned char *) queryDesc->sourceText,
+                                               strlen(queryDesc->sourceText), 0);
+    else
+        entry->text_hash = 0;
+    entry->path_hash = hash_combine64(parent ? parent->path_hash : 0, entry->text_hash);
+    // Объясняемый запрос pg_query_stack_explain_nested(): корень дерева вложенных запросов
+    if (NestedProfile != NULL && entry->depth == NestedBaseDepth && NestedRootPath == 0)
+        NestedRootPath = entry->path_hash;
+    entry->query_id = queryDesc->plannedstmt ? queryDesc->plannedstmt->queryId : UINT64CONST(0);
+    entry->child_time = 0.0;
+    entry->rows = 0;
+    entry->plan_rows = -1;
+    entry->run_limited = false;
+    memset(&entry->jit, 0, sizeof(JitInstrumentation));
+
+    // Хэш плана и отметка прогрева нужны только профилю, время старта - профилю и обратному индексу записей (для изменяющих запросов)
+    entry->plan_hash = track_profile ? pg_query_stack_plan_hash(queryDesc->plannedstmt) : 0;
+    entry->first_exec = track_profile ? pg_query_stack_warmup_first_exec(entry->text_hash) : false;
+
+    if (track_profile || NestedProfile != NULL ||
+        (track_writes && SharedState != NULL &&
+         queryDesc->plannedstmt != NULL && queryDesc->plannedstmt->resultRelations != NIL))
+        INSTR_TIME_SET_CURRENT(entry->start_time);
+    else
+        INSTR_TIME_SET_ZERO(entry->start_time);
+
+    // Добавляем запись в наш стек
+    Query_Stack = lcons(entry, Query_Stack);
+    Query_Stack_Depth++;
+
+    // Публикуем кадр в общей памяти (если она есть) и записываем в трассировку сессии (если она идёт)
+    pg_query_stack_publish_push(entry);
+    // xid, присвоенный до этого кадра, - работа родителя; новый снимок взят уже для этого кадра
+    pg_query_stack_horizon_check(parent, entry);
+    pg_query_stack_trace_push(entry);
+    pg_query_stack_report_query_id();
+    pg_query_stack_sample_push(entry);
+    
+    // Возвращаемся к предыдущему контексту
+    MemoryContextSwitchTo(oldcontext);
+
+    // Безопасная точка для запроса плана от другого backend-а
+    pg_query_stack_service_requests();
+
+    PG_TRY();
+    {
+        // Далее вызываем следующий хук или стандартную функцию
+        if (prev_ExecutorStart)
+            prev_ExecutorStart(queryDesc, eflags);
+        else
+            standard_ExecutorStart(queryDesc, eflags);
+    }
+    PG_CATCH();
+    {
+        // Убираем текущий Query_Desc из списка при ошибке и освобождаем память
+        pg_stack_free(queryDesc);
+        
+        // Заново прокидываем ошибку
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    // Узлы ещё не выполнялись (у каждого стоит ExecProcNodeFirst), так что их можно обернуть для опроса запроса плана
+    if (explain_node_poll && MySlot != NULL && queryDesc->planstate != NULL)
+        pg_query_stack_wrap_nodes(queryDesc->planstate, NULL);
+
+    // Изменяющий запрос: номер команды, которым помечены его строки, известен только после standard_ExecutorStart
+    if (queryDesc->estate != NULL && queryDesc->plannedstmt != NULL && queryDesc->plannedstmt->resultRelations != NIL)
+        pg_query_stack_register_origin(queryDesc->estate->es_output_cid, entry);
+}
+
+/*
+    Хук ExecutorRun. Нужен только профилю: отмечаем кадры, план которых выполняется порциями (count > 0) -
+    у них число полученных строк может быть меньше, чем вернул бы план целиком.
+*/
+static void
+pg_query_stack_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count, bool execute_once)
+{
+    if (count != 0 && track_profile)
+    {
+        QueryStackEntry *entry = pg_query_stack_find_frame(queryDesc);
+
+        if (entry != NULL)
+            entry->run_limited = true;
+    }
+
+    if (prev_ExecutorRun)
+        prev_ExecutorRun(queryDesc, direction, count, execute_once);
+    else
+        standard_ExecutorRun(queryDesc, direction, count, execute_once);
+}
+
+/* 
+    Хук ExecutorEnd. Убираем из стека последний запрос 
+*/
+static void
+pg_query_stack_ExecutorEnd(QueryDesc *queryDesc)
+{
+    QueryStackEntry *entry = pg_query_stack_find_frame(queryDesc);
+
+    // estate будет освобождён в standard_ExecutorEnd, поэтому всё нужное снимаем с него заранее
+    if (entry != NULL && queryDesc->estate != NULL)
+    {
+        entry->rows = queryDesc->estate->es_processed;
+
+        // Затраты JIT: свои и параллельных исполнителей (контекст JIT освобождается в standard_ExecutorEnd), оценка числа строк
+        if (track_profile && !INSTR_TIME_IS_ZERO(entry->start_time))
+        {
+            entry->plan_rows = pg_query_stack_estimated_rows(queryDesc->plannedstmt);
+
+            if (queryDesc->estate->es_jit != NULL)
+                InstrJitAgg(&entry->jit, &queryDesc->estate->es_jit->instr);
+            if (queryDesc->estate->es_jit_worker_instr != NULL)
+                InstrJitAgg(&entry->jit, queryDesc->estate->es_jit_worker_instr);
+        }
+
+        if (track_writes && SharedState != NULL && !INSTR_TIME_IS_ZERO(entry->start_time))
+            pg_query_stack_record_writes(queryDesc, entry);
+
+        // xid присваивается первой записью запроса, самый вложенный пишущий кадр завершается первым
+        pg_query_stack_horizon_check(entry, entry);
+    }
+
+    PG_TRY();
+    {
+        // Сначала вызываем предыдущие хуки 
+        if (prev_ExecutorEnd)
+            prev_ExecutorEnd(queryDesc);
+        else
+            standard_ExecutorEnd(queryDesc);
+    }
+    PG_CATCH();
+    {
+        // Убираем текущий Query_Desc из списка при ошибке и освобождаем память
+        pg_stack_free(queryDesc);
+    
+        // Заново прокидываем ошибку
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+        
+    // Убираем текущий Query_Desc из списка и учитываем завершившийся кадр в профиле
+    entry = pg_stack_free(queryDesc);
+
+    if (entry != NULL && track_profile && !INSTR_TIME_IS_ZERO(entry->start_time))
+        pg_query_stack_profile_account(entry);
+
+    if (entry != NULL && NestedProfile != NULL && entry->depth > NestedBaseDepth &&
+        !INSTR_TIME_IS_ZERO(entry->start_time))
+        pg_query_stack_nested_account(entry);
+
+    pg_query_stack_service_requests();
+}
+
+/*
+Это макрос из PostgreSQL, который объявляет информацию о функции для динамического загрузчика PostgreSQL.
+Назначение: Сообщает PostgreSQL, что функция pg_query_stack использует версию API V1 и может быть вызвана из SQL.
+Итоговый смысл:
+    - Без этого объявления PostgreSQL не сможет правильно сопоставить SQL-функцию с C-функцией в динамической библиотеке
+    - Обязательно для всех C-функций, экспортируемых в PostgreSQL
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack);
+Datum // Datum — универсальный тип данных в PostgreSQL для хранения любых значений
+pg_query_stack(PG_FUNCTION_ARGS) // PG_FUNCTION_ARGS — макрос, который представляет стандартный набор аргументов, передаваемых в функции PostgreSQL на языке C
+{
+    // Контекст вызова функции, используется для хранения информации между вызовами
+    FuncCallContext *funcctx;
+    // Получаем параметр _skip_count: это количество запросов в стеке, которые нам необходимо пропустить при возвращении результата
+    int              skip_count = PG_ARGISNULL(0) ? 0 : PG_GETARG_INT32(0);
+
+    // Параметр _frame_kind: если задан, возвращаем только кадры этого вида (старое SQL-объявление функции его не передаёт)
+    int              kind_filter = -1;
+    // Параметр _collapse: сжимать ли повторяющиеся циклы кадров (рекурсию)
+    bool             collapse = false;
+
+    if (skip_count < 0)
+        skip_count = 0;
+
+    if (PG_NARGS() > 1 && !PG_ARGISNULL(1))
+        kind_filter = (int) pg_query_stack_kind_from_name(text_to_cstring(PG_GETARG_TEXT_PP(1)));
+
+    if (PG_NARGS() > 2 && !PG_ARGISNULL(2))
+        collapse = PG_GETARG_BOOL(2);
+
+    /* 
+        Проверяем, является ли текущий вызов первым в серии вызовов SRF (set-returning function, SRF). 
+        Необходимо для инициализации переменных и настройки перед первым возвращением данных.
+    */
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext     oldcontext;
+        List             *stack_copy;
+        int               depth = 0;
+        
+        // Инициализируем FuncCallContext для хранения состояния между вызовами
+        funcctx = SRF_FIRSTCALL_INIT();
+
+        /* 
+            Переключаем контекст памяти на multi_call_memory_ctx, который живет дольше, чем текущий вызов функции.
+            Позволяет сохранять данные между вызовами функции.
+            В oldcontext сохраняется предыдущий контекст.
+            
+            Все операции по копированию и созданию списков выполняются в контексте multi_call_memory_ctx
+            , который освобождается автоматически после завершения функции. Поэтому утечки тут невозможны.
+        */
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        /* 
+            Копируем текущий стек запросов, чтобы он точно не изменился во время исполнения функции.
+            Внутри AFTER-триггера вместо кадров, под которыми он сработал, берём кадры запроса, поставившего его событие
+        */
+        if (Query_Stack != NIL)
+        {
+            stack_copy = NIL;
+            ListCell   *lc;
+            
+            foreach(lc, pg_query_stack_origin_frames())
+            {
+                QueryStackEntry *orig_entry = (QueryStackEntry *) lfirst(lc);
+                QueryStackEntry *copy_entry;
+        
+                // Выделяем память под новый QueryStackEntry в multi_call_memory_ctx
+                copy_entry = (QueryStackEntry *) palloc(sizeof(QueryStackEntry));
+                *copy_entry = *orig_entry;
+
+                // Ссылка на живой QueryDesc в копии не нужна
+                copy_entry->query_desc = NULL;
+
+                if (orig_entry->trigger_name)
+                    copy_entry->trigger_name = pstrdup(orig_entry->trigger_name);
+        
+                // Копируем query_text (у отметок глубины текста нет)
+                if (!orig_entry->captured)
+                    copy_entry->query_text = NULL;
+                else if (orig_entry->query_text)
+                    copy_entry->query_text = pstrdup(orig_entry->query_text);
+                else
+                    copy_entry->query_text = pstrdup("<unnamed query>");
+        
+                // Добавляем копию в наш список
+                stack_copy = lappend(stack_copy, copy_entry);
+            }
+            
+            // Пропускаем указанное количество элементов
+            while (depth < skip_count && stack_copy != NIL)
+            {
+                QueryStackEntry *entry = (QueryStackEntry *) linitial(stack_copy);
+        
+                // Освобождаем память под query_text и структуру, так как они больше не нужны
+                if (entry->query_text)
+                    pfree(entry->query_text);
+                pfree(entry);
+                stack_copy = list_delete_first(stack_copy);
+                
+                depth++;
+            }
+
+            /* 
+                Переворачиваем список для корректного порядка от 0 (top-level запрос), до N (самый нижний вложенный запрос).
+                И cохраняем копию стека для итерации:
+                - user_fctx — поле для хранения пользовательских данных между вызовами функции
+                ? Копирование необходимо, чтобы обеспечить консистентность данных между вызовами и избежать изменений в оригинальном стеке
+            */
+            stack_copy = pg_list_reverse_copy(stack_copy);
+
+            /*
+                Нумеруем кадры (в копии поле depth хранит номер кадра в выводе) и только потом сжимаем циклы и применяем фильтр по виду,
+                чтобы номера кадров не зависели ни от того, ни от другого
+            */
+            depth = 0;
+            foreach(lc, stack_copy)
+            {
+                QueryStackEntry *entry = (QueryStackEntry *) lfirst(lc);
+
+                entry->depth = depth++;
+                entry->repeat_count = 1;
+            }
+
+            if (collapse)
+                stack_copy = pg_query_stack_collapse_cycles(stack_copy);
+
+            funcctx->user_fctx = NIL;
+            foreach(lc, stack_copy)
+            {
+                QueryStackEntry *entry = (QueryStackEntry *) lfirst(lc);
+
+                if (kind_filter < 0 || (int) entry->kind == kind_filter)
+                    funcctx->user_fctx = lappend((List *) funcctx->user_fctx, entry);
+            }
+            
+            // Получаем количество уровней стека = по сути кол-во вложенных запросов = а также сколько раз функция будет возвращать данные
+            funcctx->max_calls = list_length((List *) funcctx->user_fctx);
+
+            /* 
+                Создаем описание кортежа при первом вызове.
+                Берём его из SQL-объявления функции, а не строим сами: объявление версии 1.0.3 возвращает только
+                frame_number и query_text, и библиотека должна работать с ним, пока не выполнен ALTER EXTENSION UPDATE.
+                Колонки 1.1.0: frame_number, query_text, frame_kind (вид кадра), trigger_name и trigger_relation
+                (триггер и его таблица, если запрос пришёл из триггера), repeat_count (повторы цикла кадров при _collapse).
+            */
+            TupleDesc tupdesc;
+
+            if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+                ereport(ERROR,
+                        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                         errmsg("function returning record called in context that cannot accept type record")));
+            
+            // Завершаем создание описания кортежа, делая его готовым для использования. Благославляем )))
+            funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        }
+        else
+        {
+            // Если у нас пустой стек то и делать нечего...
+            funcctx->user_fctx = NIL;
+            funcctx->max_calls = 0;
+        }
+
+        // Восстанавливаем предыдущий контекст памяти
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    /*
+        Устанавливает funcctx для текущего вызова функции:
+        - SRF_PERCALL_SETUP() — макрос, который восстанавливает контекст вызова функции между вызовами
+        - Необходимо для правильной работы SRF, чтобы иметь доступ к состоянию между вызовами
+    */
+    funcctx = SRF_PERCALL_SETUP();
+    
+    // Получаем наш скопированный стек из контекста
+    List       *stack = (List *) funcctx->user_fctx;
+    
+    if (stack == NIL)
+    {
+        // Сразу выходим из функции если вдруг стек пустой
+        SRF_RETURN_DONE(funcctx);
+    }
+    
+    /*
+        Получаем текущий номер вызова (call_cntr)
+        ? call_cntr автоматически увеличивается PostgreSQL при каждом вызове функции в SRF. Начинается с 0 (как и массивы/списки в С)
+    */
+    int         call_cntr = funcctx->call_cntr;
+
+    // Пока текущий номер вызова не достиг крайнего - возвращаем следующую строчку
+    if (call_cntr < funcctx->max_calls)
+    {
+        /*
+            Объявление переменных для формирования и возвращения результата
+        */
+        // Массив значений для полей кортежа
+        Datum            values[6];
+        // Массив флагов NULL для полей (NULL бывают текст отметки глубины и поля триггера)
+        bool             nulls[6] = {false, false, false, false, false, false};
+        // Непосредственно сам кортеж (строка) для возвращения
+        HeapTuple        tuple;
+        
+        /* 
+            Получаем элемент стека запросов, соответствующий текущему номеру вызова:
+            - list_nth(stack, call_cntr); возвращает call_cntr-й элемент списка stack
+            - Приводим возвращенный указатель к `QueryStackEntry *`, чтобы работать с его полями
+        */
+        QueryStackEntry *entry = (QueryStackEntry *) list_nth(stack, call_cntr);
+        
+        // Уровень вложенности запроса (при фильтре по виду он не совпадает с номером вызова)
+        int frame_number = entry->depth;
+        // Получаем текст запроса
+        const char *query_text = entry->query_text;
+
+        // Подстраховка, если вдруг запрос не получен (у отметок глубины текст остаётся NULL)
+        if (entry->captured && (query_text == NULL || query_text[0] == '\0'))
+            query_text = "<unnamed query>";
+
+        /*
+            Заполняем массив values значениями для текущего кортежа (строки).
+            - values[0] — значение для первого поля "frame_number":
+                - Возвращаем frame_number
+                - Int32GetDatum преобразует int32 в Datum.
+            - values[1] — значение для второго поля "query_text":
+                - query_text содержит текст текущего запроса.
+                - CStringGetTextDatum преобразует C-строку в Datum типа text.
+        */
+        values[0] = Int32GetDatum(frame_number);
+        if (query_text != NULL)
+            values[1] = CStringGetTextDatum(query_text);
+        else
+            nulls[1] = true;
+        values[2] = CStringGetTextDatum(QueryStackFrameKindNames[entry->kind]);
+
+        if (entry->trigger_name != NULL)
+        {
+            values[3] = CStringGetTextDatum(entry->trigger_name);
+            values[4] = ObjectIdGetDatum(entry->trigger_relid);
+        }
+        else
+        {
+            nulls[3] = true;
+            nulls[4] = true;
+        }
+
+        values[5] = Int32GetDatum(entry->repeat_count);
+
+        /* 
+            Создаем кортеж (строку) из описания кортежа и значений полей.
+            Колонок в описании может быть меньше шести (объявление 1.0.3) - лишние значения heap_form_tuple не читает.
+            heap_form_tuple объединяет описание кортежа, значения полей и информацию о NULL в один объект HeapTuple.
+        */
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+        /*
+            Преобразуем HeapTuple в Datum, чтобы вернуть его из функции. HeapTupleGetDatum оборачивает кортеж в Datum.
+            ? Функции PostgreSQL на языке C должны возвращать значения типа Datum.
+        
+            Затем возвращаем текущий результат и указываем, что есть еще данные для возвращения.
+            SRF_RETURN_NEXT — макрос, который:
+                - Увеличивает счетчик вызовов (call_cntr).
+                - Возвращает управление в цикл исполнения PostgreSQL.
+                - Обеспечивает корректное поведение SRF, позволяя функции быть вызванной снова для следующего результата.
+        */
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+    else
+    {
+        /*
+            Когда все результаты уже возвращены (call_cntr >= max_calls):
+            - SRF_RETURN_DONE(funcctx); — макрос, который сообщает PostgreSQL, что функция завершила возвращение всех данных.
+        */
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+
+// Колонки p50, p95, p99 и максимума времени по гистограмме (NULL, если выполнений не было)
+static void
+pg_query_stack_put_percentiles(const QueryStackHistogram *hist, Datum *values, bool *nulls)
+{
+    static const double quantiles[3] = {0.5, 0.95, 0.99};
+    int         i;
+
+    for (i = 0; i < 3; i++)
+    {
+        double      value;
+
+        if (pg_query_stack_hist_quantile(hist, quantiles[i], &value))
+            values[i] = Float8GetDatum(value);
+        else
+            nulls[i] = true;
+    }
+
+    values[3] = Float8GetDatum(hist->max_time);
+}
+
+
+/*
+    pg_query_stack_profile() - профиль путей вызовов текущей сессии.
+    Одна строка на пару (путь вызовов, форма плана). Колонка path_plans показывает, сколькими разными планами
+    выполнялся запрос на этом пути: значение больше 1 означает, что план "переключался".
+    Дерево путей восстанавливается по parent_path_hash (0 - верхний уровень).
+    Колонка jit_dominates отмечает пути, где JIT-компиляция заняла больше времени, чем само выполнение.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_profile);
+Datum
+pg_query_stack_profile(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    HASH_SEQ_STATUS status;
+    QueryStackProfileEntry *pentry;
+    HTAB       *plans_per_path;
+    HASHCTL     ctl;
+
+    // Результат формируем целиком в tuplestore, описание колонок берём из SQL-объявления функции
+    InitMaterializedSRF(fcinfo, 0);
+
+    if (ProfileHash == NULL)
+        PG_RETURN_VOID();
+
+    // Первый проход: сколько разных планов у каждого пути
+    ctl.keysize = sizeof(uint64);
+    ctl.entrysize = sizeof(QueryStackPathPlans);
+    ctl.hcxt = CurrentMemoryContext;
+    plans_per_path = hash_create("pg_query_stack plans per path", 256, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    hash_seq_init(&status, ProfileHash);
+    while ((pentry = (QueryStackProfileEntry *) hash_seq_search(&status)) != NULL)
+    {
+        bool        found;
+        QueryStackPathPlans *path = (QueryStackPathPlans *) hash_search(plans_per_path, &pentry->key.path_hash,
+                                                                        HASH_ENTER, &found);
+
+        if (!found)
+            path->nplans = 0;
+        path->nplans++;
+    }
+
+    // Второй проход: сами строки
+    hash_seq_init(&status, ProfileHash);
+    while ((pentry = (QueryStackProfileEntry *) hash_seq_search(&status)) != NULL)
+    {
+        Datum       values[23];
+        bool        nulls[23] = {0};
+        QueryStackPathPlans *path = (QueryStackPathPlans *) hash_search(plans_per_path, &pentry->key.path_hash,
+                                                                        HASH_FIND, NULL);
+        QueryStackCounters *c = &pentry->counters;
+        double      jit_time;
+
+        values[0] = Int64GetDatum((int64) pentry->key.path_hash);
+        values[1] = Int64GetDatum((int64) pentry->parent_path_hash);
+        values[2] = Int64GetDatum((int64) pentry->key.plan_hash);
+        values[3] = Int32GetDatum(path->nplans);
+        values[4] = Int32GetDatum(pentry->depth);
+        values[5] = CStringGetTextDatum(QueryStackFrameKindNames[pentry->kind]);
+        if (pentry->query_text != NULL)
+            values[6] = CStringGetTextDatum(pentry->query_text);
+        else
+            nulls[6] = true;
+        values[7] = Int64GetDatum(c->calls);
+        values[8] = Float8GetDatum(c->total_time);
+        values[9] = Float8GetDatum(c->self_time);
+        values[10] = Int64GetDatum(c->rows);
+        values[11] = Int64GetDatum(c->jit_functions);
+        values[12] = Float8GetDatum(c->jit_generation_time);
+        values[13] = Float8GetDatum(c->jit_inlining_time);
+        values[14] = Float8GetDatum(c->jit_optimization_time);
+        values[15] = Float8GetDatum(c->jit_emission_time);
+        // JIT дороже самого выполнения: время кадра включает компиляцию, сравниваем с остатком
+        jit_time = c->jit_generation_time + c->jit_inlining_time + c->jit_optimization_time + c->jit_emission_time;
+        values[16] = BoolGetDatum(jit_time > 0 && jit_time > c->total_time - jit_time);
+        values[17] = Int64GetDatum(c->warmup_calls);
+        values[18] = Float8GetDatum(c->warmup_time);
+        pg_query_stack_put_percentiles(&c->histogram, values + 19, nulls + 19);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    hash_destroy(plans_per_path);
+
+    PG_RETURN_VOID();
+}
+
+
+/*
+    pg_query_stack_function_warmup() - стоимость прогрева функций PL/pgSQL в текущей сессии:
+    время первых вызовов после компиляции отдельно от времени остальных вызовов.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_function_warmup);
+Datum
+pg_query_stack_function_warmup(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    HASH_SEQ_STATUS status;
+    QueryStackFuncProfileEntry *fentry;
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    if (FuncProfileHash == NULL)
+        PG_RETURN_VOID();
+
+    hash_seq_init(&status, FuncProfileHash);
+    while ((fentry = (QueryStackFuncProfileEntry *) hash_seq_search(&status)) != NULL)
+    {
+        Datum       values[5];
+        bool        nulls[5] = {0};
+
+        values[0] = ObjectIdGetDatum(fentry->fn_oid);
+        values[1] = Int64GetDatum(fentry->compiles);
+        values[2] = Float8GetDatum(fentry->warmup_time);
+        values[3] = Int64GetDatum(fentry->calls - fentry->warmup_calls);
+        values[4] = Float8GetDatum(Max(fentry->total_time - fentry->warmup_time, 0.0));
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    PG_RETURN_VOID();
+}
+
+
+/*
+    pg_query_stack_misestimates(min_factor, min_calls) - пути вызовов текущей сессии, у которых оценка числа строк плана
+    устойчиво расходится с фактом: среднегеометрическое отношение факт/оценка не меньше min_factor или не больше 1 / min_factor
+    (ошибки в разные стороны при этом взаимно гасятся). Вместе с путём выводится стек вызывающих кадров из того же профиля.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_misestimates);
+Datum
+pg_query_stack_misestimates(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    double      min_factor = PG_ARGISNULL(0) ? 10.0 : PG_GETARG_FLOAT8(0);
+    int64       min_calls = PG_ARGISNULL(1) ? 10 : PG_GETARG_INT64(1);
+    HASH_SEQ_STATUS status;
+    QueryStackProfileEntry *pentry;
+    HTAB       *paths;
+    HASHCTL     ctl;
+
+    if (min_factor < 1.0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("min_factor must be at least 1")));
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    if (ProfileHash == NULL)
+        PG_RETURN_VOID();
+
+    // Первый проход: запись профиля по пути вызовов (для восстановления стека вызывающих кадров)
+    ctl.keysize = sizeof(uint64);
+    ctl.entrysize = sizeof(QueryStackPathEntry);
+    ctl.hcxt = CurrentMemoryContext;
+    paths = hash_create("pg_query_stack profile paths", 256, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    hash_seq_init(&status, ProfileHash);
+    while ((pentry = (QueryStackProfileEntry *) hash_seq_search(&status)) != NULL)
+    {
+        bool        found;
+        QueryStackPathEntry *path = (QueryStackPathEntry *) hash_search(paths, &pentry->key.path_hash,
+                                                                        HASH_ENTER, &found);
+
+        if (!found)
+            path->entry = pentry;
+    }
+
+    // Второй проход: пути с устойчивой ошибкой оценки
+    hash_seq_init(&status, ProfileHash);
+    while ((pentry = (QueryStackProfileEntry *) hash_seq_search(&status)) != NULL)
+    {
+        Datum       values[10];
+        bool        nulls[10] = {0};
+        QueryStackCounters *c = &pentry->counters;
+        double      error_factor;
+        uint64      parent_path_hash;
+        QueryStackProfileEntry *chain[64];
+        int         n = 0;
+        StringInfoData buf;
+
+        if (c->est_calls < Max(min_calls, 1))
+            continue;
+
+        // Типичная ошибка в разах - среднее |ln(факт / оценка)|: занижение в 100 раз и завышение в 100 раз не гасят друг друга
+        error_factor = exp(c->est_abs_log_ratio / c->est_calls);
+        if (error_factor < min_factor)
+            continue;
+
+        // Вызывающие кадры по родительским путям (глубина ограничена, пути могут быть вытеснены из профиля)
+        parent_path_hash = pentry->parent_path_hash;
+        while (parent_path_hash != 0 && n < (int) lengthof(chain))
+        {
+            QueryStackPathEntry *path = (QueryStackPathEntry *) hash_search(paths, &parent_path_hash,
+                                                                            HASH_FIND, NULL);
+
+            if (path == NULL)
+                break;
+            chain[n] = path->entry;
+            parent_path_hash = chain[n]->parent_path_hash;
+            n++;
+        }
+
+        initStringInfo(&buf);
+        while (n-- > 0 && buf.len < STACK_TEXT_LEN)
+        {
+            pg_query_stack_append_frame_label(&buf, chain[n]->query_text);
+            appendStringInfoString(&buf, " > ");
+        }
+        pg_query_stack_append_frame_label(&buf, pentry->query_text);
+
+        values[0] = Int64GetDatum((int64) pentry->key.path_hash);
+        values[1] = Int64GetDatum((int64) pentry->key.plan_hash);
+        values[2] = CStringGetTextDatum(buf.data);
+        if (pentry->query_text != NULL)
+            values[3] = CStringGetTextDatum(pentry->query_text);
+        else
+            nulls[3] = true;
+        values[4] = Int64GetDatum(c->calls);
+        values[5] = Int64GetDatum(c->est_calls);
+        values[6] = Float8GetDatum(c->est_rows / c->est_calls);
+        values[7] = Float8GetDatum(c->est_actual_rows / c->est_calls);
+        values[8] = Float8GetDatum(error_factor);
+        // Направление: среднегеометрическое факт / оценка (больше 1 - недооценка, около 1 - ошибки в обе стороны)
+        values[9] = Float8GetDatum(exp(c->est_log_ratio / c->est_calls));
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        pfree(buf.data);
+    }
+
+    hash_destroy(paths);
+
+    PG_RETURN_VOID();
+}
+
+
+/*
+    pg_query_stack_dynamic_plans(min_plans) - динамические запросы функций PL/pgSQL, спланированные в сессии не меньше min_plans раз,
+    с вызывающим стеком и суммарным временем планирования. Кандидаты на перевод в параметризованные или подготовленные запросы.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_dynamic_plans);
+Datum
+pg_query_stack_dynamic_plans(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    int64       min_plans = PG_ARGISNULL(0) ? 100 : PG_GETARG_INT32(0);
+    HASH_SEQ_STATUS status;
+    QueryStackDynamicPlanEntry *dentry;
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    if (DynamicPlanHash == NULL)
+        PG_RETURN_VOID();
+
+    hash_seq_init(&status, DynamicPlanHash);
+    while ((dentry = (QueryStackDynamicPlanEntry *) hash_seq_search(&status)) != NULL)
+    {
+        Datum       values[8];
+        bool        nulls[8] = {0};
+
+        if (dentry->plans < min_plans)
+            continue;
+
+        values[0] = Int64GetDatum((int64) dentry->key.caller_path_hash);
+        if (dentry->caller_stack != NULL)
+            values[1] = CStringGetTextDatum(dentry->caller_stack);
+        else
+            nulls[1] = true;
+        values[2] = ObjectIdGetDatum(dentry->key.fn_oid);
+        values[3] = Int64GetDatum((int64) dentry->key.query_hash);
+        if (dentry->query_text != NULL)
+            values[4] = CStringGetTextDatum(dentry->query_text);
+        else
+            nulls[4] = true;
+        values[5] = Int64GetDatum(dentry->plans);
+        values[6] = Float8GetDatum(dentry->plan_time);
+        values[7] = Float8GetDatum(dentry->plan_time / dentry->plans);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    PG_RETURN_VOID();
+}
+
+
+// pg_query_stack_profile_reset() - очистка профиля путей вызовов текущей сессии
+PG_FUNCTION_INFO_V1(pg_query_stack_profile_reset);
+Datum
+pg_query_stack_profile_reset(PG_FUNCTION_ARGS)
+{
+    if (ProfileContext != NULL)
+    {
+        MemoryContextDelete(ProfileContext);
+        ProfileContext = NULL;
+        ProfileHash = NULL;
+        WarmupTextHash = NULL;
+        FuncProfileHash = NULL;
+        DynamicPlanHash = NULL;
+    }
+
+    PG_RETURN_VOID();
+}
+
+
+/*
+    pg_query_stack_active_frames() - опубликованные кадры всех backend-ов кластера.
+    На её основе построено представление pg_query_stack_duplicates (одинаковая работа, выполняемая одновременно).
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_active_frames);
+Datum
+pg_query_stack_active_frames(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    QueryStackBackendSlot *local_slot;
+    int         i;
+
+    pg_query_stack_require_shmem("pg_query_stack_active_frames()");
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    local_slot = (QueryStackBackendSlot *) palloc(SharedState->slot_size);
+
+    for (i = 0; i < SharedState->nslots; i++)
+    {
+        volatile QueryStackBackendSlot *slot = SharedSlot(SharedState, i);
+        int         frame;
+
+        // Копируем слот целиком, повторяя чтение, пока владелец его не меняет
+        for (;;)
+        {
+            int         before_changecount = slot->changecount;
+
+            pg_read_barrier();
+            memcpy(local_slot, (QueryStackBackendSlot *) slot, SharedState->slot_size);
+            pg_read_barrier();
+
+            if (before_changecount == slot->changecount && (before_changecount & 1) == 0)
+                break;
+
+            CHECK_FOR_INTERRUPTS();
+        }
+
+        if (local_slot->pid == 0)
+            continue;
+
+        for (frame = 0; frame < local_slot->depth; frame++)
+        {
+            Datum       values[6];
+            bool        nulls[6] = {0};
+
+            values[0] = Int32GetDatum(local_slot->pid);
+            values[1] = ObjectIdGetDatum(local_slot->dbid);
+            values[2] = Int32GetDatum(frame);
+            values[3] = Int64GetDatum((int64) local_slot->frames[frame].path_hash);
+            values[4] = Int64GetDatum((int64) local_slot->frames[frame].text_hash);
+            values[5] = TimestampTzGetDatum(local_slot->frames[frame].start_time);
+
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
     }
+
+    pfree(local_slot);
+
+    PG_RETURN_VOID();
+}
+
+
+/*
+    pg_query_stack_horizon_blame() - опубликованные кадры, в которых backend-ы получили xid и взяли удерживаемый снимок.
+    Значения могут быть устаревшими (снимок уже отпущен), сверка с pg_stat_activity - в представлении pg_query_stack_horizon.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_horizon_blame);
+Datum
+pg_query_stack_horizon_blame(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    QueryStackBackendSlot *local_slot;
+    bool        read_all;
+    int         i;
+
+    pg_query_stack_require_shmem("pg_query_stack_horizon_blame()");
+
+    read_all = pg_query_stack_can_read_texts();
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    local_slot = (QueryStackBackendSlot *) palloc(SharedState->slot_size);
+
+    for (i = 0; i < SharedState->nslots; i++)
+    {
+        volatile QueryStackBackendSlot *slot = SharedSlot(SharedState, i);
+        Datum       values[7];
+        bool        nulls[7] = {0};
+        bool        read_stacks;
+
+        // Копируем слот целиком, повторяя чтение, пока владелец его не меняет
+        for (;;)
+        {
+            int         before_changecount = slot->changecount;
+
+            pg_read_barrier();
+            memcpy(local_slot, (QueryStackBackendSlot *) slot, SharedState->slot_size);
+            pg_read_barrier();
+
+            if (before_changecount == slot->changecount && (before_changecount & 1) == 0)
+                break;
+
+            CHECK_FOR_INTERRUPTS();
+        }
+
+        if (local_slot->pid == 0 ||
+            (local_slot->xid == InvalidTransactionId && local_slot->xmin == InvalidTransactionId))
+            continue;
+
+        // Как в pg_stat_activity: стеки чужих сессий видны только с правами их пользователя или pg_read_all_stats
+        read_stacks = read_all || has_privs_of_role(GetUserId(), local_slot->userid);
+
+        values[0] = Int32GetDatum(local_slot->pid);
+
+        if (local_slot->xid != InvalidTransactionId)
+        {
+            values[1] = TransactionIdGetDatum(local_slot->xid);
+            // Пустой стек - xid присвоен вне отслеживаемых запросов (например, командой DDL верхнего уровня)
+            if (read_stacks && local_slot->xid_stack[0] != '\0')
+                values[2] = CStringGetTextDatum(local_slot->xid_stack);
+            else
+                nulls[2] = true;
+            values[3] = TimestampTzGetDatum(local_slot->xid_time);
+        }
+        else
+            nulls[1] = nulls[2] = nulls[3] = true;
+
+        if (local_slot->xmin != InvalidTransactionId)
+        {
+            values[4] = TransactionIdGetDatum(local_slot->xmin);
+            if (read_stacks)
+                values[5] = CStringGetTextDatum(local_slot->xmin_stack);
+            else
+                nulls[5] = true;
+            values[6] = TimestampTzGetDatum(local_slot->xmin_time);
+        }
+        else
+            nulls[4] = nulls[5] = nulls[6] = true;
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    pfree(local_slot);
+
+    PG_RETURN_VOID();
+}
+
+
+/*
+    pg_query_stack_writers() - обратный индекс "кто пишет в таблицу" по всем базам кластера.
+    Для текущей базы удобнее представление pg_query_stack_table_writers.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_writers);
+Datum
+pg_query_stack_writers(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    HASH_SEQ_STATUS status;
+    QueryStackSharedWrite *shared;
+    bool        read_texts;
+
+    pg_query_stack_require_shmem("pg_query_stack_writers()");
+
+    read_texts = pg_query_stack_can_read_texts();
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    LWLockAcquire(SharedState->lock, LW_SHARED);
+
+    hash_seq_init(&status, SharedWritesHash);
+    while ((shared = (QueryStackSharedWrite *) hash_seq_search(&status)) != NULL)
+    {
+        Datum       values[8];
+        bool        nulls[8] = {0};
+        QueryStackWriteCounters counters;
+
+        SpinLockAcquire(&shared->mutex);
+        counters = shared->counters;
+        SpinLockRelease(&shared->mutex);
+
+        values[0] = ObjectIdGetDatum(shared->key.dbid);
+        values[1] = ObjectIdGetDatum(shared->key.relid);
+        values[2] = CStringGetTextDatum(pg_query_stack_operation_name((CmdType) shared->key.operation));
+        values[3] = Int64GetDatum((int64) shared->key.path_hash);
+        if (read_texts)
+            values[4] = CStringGetTextDatum(shared->stack_text);
+        else
+            nulls[4] = true;
+        values[5] = Int64GetDatum(counters.calls);
+        values[6] = Int64GetDatum(counters.rows);
+        values[7] = Float8GetDatum(counters.total_time);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    LWLockRelease(SharedState->lock);
+
+    PG_RETURN_VOID();
+}
+
+
+// pg_query_stack_writers_reset() - очистка обратного индекса записей
+PG_FUNCTION_INFO_V1(pg_query_stack_writers_reset);
+Datum
+pg_query_stack_writers_reset(PG_FUNCTION_ARGS)
+{
+    HASH_SEQ_STATUS status;
+    QueryStackSharedWrite *shared;
+
+    pg_query_stack_require_shmem("pg_query_stack_writers_reset()");
+
+    LWLockAcquire(SharedState->lock, LW_EXCLUSIVE);
+
+    hash_seq_init(&status, SharedWritesHash);
+    while ((shared = (QueryStackSharedWrite *) hash_seq_search(&status)) != NULL)
+        hash_search(SharedWritesHash, &shared->key, HASH_REMOVE, NULL);
+
+    LWLockRelease(SharedState->lock);
+
+    PG_RETURN_VOID();
+}
+
+
+/*
+    pg_query_stack_trace_start(max_events) - начало записи трассировки сессии.
+    Буфер на max_events событий выделяется (и заполняется нулями) сразу, чтобы запись события не выделяла память.
+    Повторный вызов начинает трассировку заново.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_trace_start);
+Datum
+pg_query_stack_trace_start(PG_FUNCTION_ARGS)
+{
+    int         max_events = PG_ARGISNULL(0) ? 100000 : PG_GETARG_INT32(0);
+    int         limit = (int) Min(MaxAllocSize / sizeof(QueryStackTraceEvent), INT_MAX);
+
+    if (max_events < 2 || max_events > limit)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("max_events must be between 2 and %d", limit)));
+
+    pg_query_stack_trace_discard();
+
+    TraceContext = AllocSetContextCreate(TopMemoryContext,
+                                         "pg_query_stack trace",
+                                         ALLOCSET_DEFAULT_SIZES);
+    TraceEvents = (QueryStackTraceEvent *) MemoryContextAllocZero(TraceContext,
+                                                                  (Size) max_events * sizeof(QueryStackTraceEvent));
+    TraceMaxEvents = max_events;
+    INSTR_TIME_SET_CURRENT(TraceStartTime);
+    TraceActive = true;
+
+    PG_RETURN_VOID();
+}
+
+
+/*
+    pg_query_stack_trace_stop() - остановка записи, трассировка возвращается как JSON в формате Chrome trace event
+    (открывается в chrome://tracing и ui.perfetto.dev).
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_trace_stop);
+Datum
+pg_query_stack_trace_stop(PG_FUNCTION_ARGS)
+{
+    StringInfoData buf;
+    int         i;
+
+    pg_query_stack_trace_finish();
+
+    initStringInfo(&buf);
+    pg_query_stack_trace_append_header(&buf);
+    for (i = 0; i < TraceNEvents; i++)
+    {
+        if (i > 0)
+            appendStringInfoChar(&buf, ',');
+        pg_query_stack_trace_append_event(&buf, &TraceEvents[i]);
+    }
+    pg_query_stack_trace_append_footer(&buf);
+
+    pg_query_stack_trace_discard();
+
+    PG_RETURN_TEXT_P(cstring_to_text_with_len(buf.data, buf.len));
+}
+
+
+/*
+    pg_query_stack_trace_stop(filename) - остановка записи с сохранением трассировки в файл на сервере.
+    Как и COPY ... TO 'file', требует прав pg_write_server_files и абсолютного пути. Возвращает количество записанных событий.
+    Если файл записать не удалось, трассировка остаётся доступной для повторного вызова.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_trace_stop_to_file);
+Datum
+pg_query_stack_trace_stop_to_file(PG_FUNCTION_ARGS)
+{
+    char       *filename = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    StringInfoData buf;
+    FILE       *file;
+    int         nevents;
+    int         i;
+
+    if (!has_privs_of_role(GetUserId(), ROLE_PG_WRITE_SERVER_FILES))
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("permission denied to write pg_query_stack trace to a file"),
+                 errdetail("Only roles with privileges of the \"%s\" role may write files on the server.",
+                           "pg_write_server_files")));
+
+    if (!is_absolute_path(filename))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_NAME),
+                 errmsg("relative path not allowed for pg_query_stack trace file")));
+
+    pg_query_stack_trace_finish();
+
+    file = AllocateFile(filename, PG_BINARY_W);
+    if (file == NULL)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open file \"%s\" for writing: %m", filename)));
+
+    // Пишем частями: вся трассировка в одну строку может не поместиться
+    initStringInfo(&buf);
+    pg_query_stack_trace_append_header(&buf);
+    for (i = 0; i <= TraceNEvents; i++)
+    {
+        if (i == TraceNEvents)
+            pg_query_stack_trace_append_footer(&buf);
+        else
+        {
+            if (i > 0)
+                appendStringInfoChar(&buf, ',');
+            pg_query_stack_trace_append_event(&buf, &TraceEvents[i]);
+        }
+
+        if (buf.len >= TRACE_WRITE_CHUNK || i == TraceNEvents)
+        {
+            if (fwrite(buf.data, 1, buf.len, file) != buf.len)
+                ereport(ERROR,
+                        (errcode_for_file_access(),
+                         errmsg("could not write file \"%s\": %m", filename)));
+            resetStringInfo(&buf);
+        }
+
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    if (FreeFile(file) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not close file \"%s\": %m", filename)));
+
+    nevents = TraceNEvents;
+    pg_query_stack_trace_discard();
+
+    PG_RETURN_INT64(nevents);
+}
+
+
+/*
+    pg_query_stack_sample_start(interval_ms, max_paths) - начало сэмплирования стека сессии по таймеру.
+    Таблица на max_paths путей вызовов выделяется сразу, чтобы обработчик таймера не выделял память.
+    Повторный вызов начинает сэмплирование заново.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_sample_start);
+Datum
+pg_query_stack_sample_start(PG_FUNCTION_ARGS)
+{
+    int         interval_ms = PG_ARGISNULL(0) ? 10 : PG_GETARG_INT32(0);
+    int         max_paths = PG_ARGISNULL(1) ? 10000 : PG_GETARG_INT32(1);
+    HASHCTL     ctl;
+    ListCell   *lc;
+
+    if (interval_ms < 1 || interval_ms > 3600000)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("interval_ms must be between 1 and 3600000")));
+
+    if (max_paths < 1 || max_paths > (1 << 24))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("max_paths must be between 1 and %d", 1 << 24)));
+
+    pg_query_stack_sample_discard();
+
+    if (SampleTimeoutId == MAX_TIMEOUTS)
+        SampleTimeoutId = RegisterTimeout(USER_TIMEOUT, pg_query_stack_sample_handler);
+
+    SampleContext = AllocSetContextCreate(TopMemoryContext,
+                                          "pg_query_stack sampling",
+                                          ALLOCSET_DEFAULT_SIZES);
+
+    SampleMaxPaths = (uint32) max_paths;
+    SampleSize = pg_nextpower2_32(SampleMaxPaths * 2);
+    SampleUsed = 0;
+    SampleTotal = 0;
+    SampleDropped = 0;
+    SampleSlots = (volatile QueryStackSampleSlot *) MemoryContextAllocZero(SampleContext,
+                                                                           (Size) SampleSize * sizeof(QueryStackSampleSlot));
+
+    ctl.keysize = sizeof(uint64);
+    ctl.entrysize = sizeof(QueryStackSamplePath);
+    ctl.hcxt = SampleContext;
+    SamplePaths = hash_create("pg_query_stack sample paths", 256, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    // Кадры, уже лежащие на стеке (в том числе кадр этого вызова), дальше добавляться не будут
+    foreach(lc, Query_Stack)
+        pg_query_stack_sample_register((QueryStackEntry *) lfirst(lc));
+
+    SampleInterval = interval_ms;
+    SampleActive = true;
+    pg_query_stack_sample_sync();
+    pg_query_stack_sample_enable();
+
+    PG_RETURN_VOID();
+}
+
+
+/*
+    pg_query_stack_sample_stop() - остановка таймера. Собранный профиль остаётся доступен pg_query_stack_sample_report().
+    Возвращает количество срабатываний таймера (включая те, что пришлись на пустой стек).
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_sample_stop);
+Datum
+pg_query_stack_sample_stop(PG_FUNCTION_ARGS)
+{
+    if (SampleTimeoutId != MAX_TIMEOUTS && get_timeout_active(SampleTimeoutId))
+        disable_timeout(SampleTimeoutId, false);
+    SampleActive = false;
+
+    if (SampleDropped > 0)
+        ereport(NOTICE,
+                (errmsg("%llu samples of new call paths were dropped because the sample table was full",
+                        (unsigned long long) SampleDropped),
+                 errhint("Increase max_paths of pg_query_stack_sample_start().")));
+
+    PG_RETURN_INT64((int64) SampleTotal);
+}
+
+
+/*
+    pg_query_stack_sample_report() - собранный профиль в виде свёрнутых стеков (folded stacks):
+    подписи кадров от верхнего уровня через ';' и количество сэмплов, пришедшихся на этот путь.
+    Можно вызывать как во время сэмплирования, так и после остановки.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_sample_report);
+Datum
+pg_query_stack_sample_report(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    uint32      i;
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    for (i = 0; SampleSlots != NULL && i < SampleSize; i++)
+    {
+        Datum       values[2];
+        bool        nulls[2] = {0};
+        uint64      path_hash = SampleSlots[i].path_hash;
+        QueryStackSamplePath *path;
+
+        if (path_hash == 0)
+            continue;
+
+        path = (QueryStackSamplePath *) hash_search(SamplePaths, &path_hash, HASH_FIND, NULL);
+
+        values[0] = CStringGetTextDatum(path ? path->stack : "<unknown>");
+        values[1] = Int64GetDatum((int64) SampleSlots[i].samples);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    PG_RETURN_VOID();
+}
+
+
+/*
+    pg_query_stack_explain(pid, frame) - запрос плана выполняющегося кадра другого backend-а.
+    Целевой backend в ближайшей безопасной точке (добавление или снятие кадра, начало оператора PL/pgSQL)
+    строит план по живому QueryDesc кадра и пишет его в журнал сервера. frame - номер кадра как в
+    pg_query_stack_active_frames (0 - верхний уровень), NULL - самый вложенный выполняющийся кадр.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_explain);
+Datum
+pg_query_stack_explain(PG_FUNCTION_ARGS)
+{
+    int         pid;
+    uint32      frame_code = EXPLAIN_INNERMOST_FRAME;
+    int         i;
+
+    pg_query_stack_require_shmem("pg_query_stack_explain()");
+
+    if (PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+    pid = PG_GETARG_INT32(0);
+
+    if (!PG_ARGISNULL(1))
+    {
+        int         frame = PG_GETARG_INT32(1);
+
+        if (frame < 0)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("frame number must not be negative")));
+        frame_code = (uint32) frame + 1;
+    }
+
+    for (i = 0; i < SharedState->nslots; i++)
+    {
+        QueryStackBackendSlot *slot = SharedSlot(SharedState, i);
+
+        if (((volatile QueryStackBackendSlot *) slot)->pid == pid)
+        {
+            pg_atomic_write_u64(&slot->explain_request, ((uint64) (uint32) MyProcPid << 32) | frame_code);
+            PG_RETURN_BOOL(true);
+        }
+    }
+
+    ereport(WARNING,
+            (errmsg("PID %d is not a backend tracked by pg_query_stack", pid)));
+
+    PG_RETURN_BOOL(false);
+}
+
+
+/*
+    pg_query_stack_shared_profile() - общий профиль путей вызовов по всем сессиям кластера с включённым track_profile.
+    Одна строка на (база, путь вызовов, форма плана), процентили считаются по объединённым гистограммам сессий.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_shared_profile);
+Datum
+pg_query_stack_shared_profile(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    HASH_SEQ_STATUS status;
+    QueryStackSharedProfileEntry *shared;
+    bool        read_texts;
+    int64       dropped;
+
+    pg_query_stack_require_shmem("pg_query_stack_shared_profile()");
+
+    read_texts = pg_query_stack_can_read_texts();
+    dropped = (int64) pg_atomic_read_u64(&SharedState->profile_dropped);
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    LWLockAcquire(SharedState->lock, LW_SHARED);
+
+    hash_seq_init(&status, SharedProfileHash);
+    while ((shared = (QueryStackSharedProfileEntry *) hash_seq_search(&status)) != NULL)
+    {
+        Datum       values[19];
+        bool        nulls[19] = {0};
+        QueryStackCounters counters;
+        QueryStackCounters *c = &counters;
+
+        SpinLockAcquire(&shared->mutex);
+        counters = shared->counters;
+        SpinLockRelease(&shared->mutex);
+
+        values[0] = ObjectIdGetDatum(shared->key.dbid);
+        values[1] = Int64GetDatum((int64) shared->key.path_hash);
+        values[2] = Int64GetDatum((int64) shared->parent_path_hash);
+        values[3] = Int64GetDatum((int64) shared->key.plan_hash);
+        values[4] = Int32GetDatum(shared->depth);
+        values[5] = CStringGetTextDatum(QueryStackFrameKindNames[shared->kind]);
+        if (read_texts && shared->query_text[0] != '\0')
+            values[6] = CStringGetTextDatum(shared->query_text);
+        else
+            nulls[6] = true;
+        values[7] = Int64GetDatum(c->calls);
+        values[8] = Float8GetDatum(c->total_time);
+        values[9] = Float8GetDatum(c->self_time);
+        values[10] = Int64GetDatum(c->rows);
+        pg_query_stack_put_percentiles(&c->histogram, values + 11, nulls + 11);
+        // Ошибка оценки числа строк, как в pg_query_stack_misestimates()
+        values[15] = Int64GetDatum(c->est_calls);
+        if (c->est_calls > 0)
+        {
+            values[16] = Float8GetDatum(exp(c->est_abs_log_ratio / c->est_calls));
+            values[17] = Float8GetDatum(exp(c->est_log_ratio / c->est_calls));
+        }
+        else
+            nulls[16] = nulls[17] = true;
+        values[18] = Int64GetDatum(dropped);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    LWLockRelease(SharedState->lock);
+
+    PG_RETURN_VOID();
+}
+
+
+// pg_query_stack_shared_profile_reset() - очистка общего профиля путей вызовов
+PG_FUNCTION_INFO_V1(pg_query_stack_shared_profile_reset);
+Datum
+pg_query_stack_shared_profile_reset(PG_FUNCTION_ARGS)
+{
+    HASH_SEQ_STATUS status;
+    QueryStackSharedProfileEntry *shared;
+
+    pg_query_stack_require_shmem("pg_query_stack_shared_profile_reset()");
+
+    LWLockAcquire(SharedState->lock, LW_EXCLUSIVE);
+
+    hash_seq_init(&status, SharedProfileHash);
+    while ((shared = (QueryStackSharedProfileEntry *) hash_seq_search(&status)) != NULL)
+        hash_search(SharedProfileHash, &shared->key, HASH_REMOVE, NULL);
+    pg_atomic_write_u64(&SharedState->profile_dropped, 0);
+
+    LWLockRelease(SharedState->lock);
+
+    PG_RETURN_VOID();
+}
+
+
+/*
+    pg_query_stack_profile_windows(_windows) - профиль по окнам времени за последние _windows окон (NULL - все окна кольца).
+    Окно, которое сейчас заполняется, возвращается тоже (is_current), его данные неполные.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_profile_windows);
+Datum
+pg_query_stack_profile_windows(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    int64       current;
+    int         nwindows;
+    int         w;
+
+    pg_query_stack_require_shmem("pg_query_stack_profile_windows()");
+
+    nwindows = PG_ARGISNULL(0) ? window_count : Min(Max(PG_GETARG_INT32(0), 0), window_count);
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    current = pg_query_stack_current_epoch();
+
+    for (w = 0; w < nwindows; w++)
+    {
+        int64       epoch = current - w;
+        QueryStackWindow *window;
+        TimestampTz window_start;
+        int         i;
+
+        if (epoch < 0)
+            break;
+
+        window = SharedWindow(epoch % window_count);
+        window_start = (TimestampTz) (epoch * window_seconds * USECS_PER_SEC);
+
+        LWLockAcquire(window->lock, LW_SHARED);
+
+        // Окно ещё хранит более старую эпоху (за это время не было ни одной транзакции) - оно пустое
+        if (window->epoch != epoch)
+        {
+            LWLockRelease(window->lock);
+            continue;
+        }
+
+        for (i = 0; i < window_entries; i++)
+        {
+            QueryStackWindowEntry *wentry = &window->entries[i];
+            Datum       values[10];
+            bool        nulls[10] = {0};
+
+            if (wentry->epoch != epoch)
+                continue;
+
+            values[0] = TimestampTzGetDatum(window_start);
+            values[1] = BoolGetDatum(w == 0);
+            values[2] = ObjectIdGetDatum(wentry->key.dbid);
+            values[3] = Int64GetDatum((int64) wentry->key.path_hash);
+            values[4] = Int64GetDatum((int64) wentry->key.plan_hash);
+            values[5] = Int64GetDatum(wentry->calls);
+            values[6] = Float8GetDatum(wentry->total_time);
+            values[7] = Float8GetDatum(wentry->self_time);
+            values[8] = Int64GetDatum(wentry->rows);
+            values[9] = Int64GetDatum(window->dropped);
+
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+
+        LWLockRelease(window->lock);
+    }
+
+    PG_RETURN_VOID();
+}
+
+
+/*
+    pg_query_stack_explain_nested(query, options) - EXPLAIN ANALYZE запроса, под планом которого выводится дерево
+    вложенных запросов, выполнившихся во время объясняемого (вызовы функций, триггеры и т.д.), с количеством вызовов,
+    временем и строками по каждому пути вызовов. Опции добавляются к ANALYZE (например, 'BUFFERS, VERBOSE').
+    Хуков для собственных опций EXPLAIN в Postgres 16 нет, поэтому это функция-обёртка.
+*/
+PG_FUNCTION_INFO_V1(pg_query_stack_explain_nested);
+Datum
+pg_query_stack_explain_nested(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    char       *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    char       *options = PG_ARGISNULL(1) ? NULL : text_to_cstring(PG_GETARG_TEXT_PP(1));
+    StringInfoData command;
+    HASHCTL     ctl;
+    HTAB       *collected;
+    HASH_SEQ_STATUS status;
+    QueryStackNestedEntry *nentry;
+    List       *entries = NIL;
+    uint64      i;
+
+    if (NestedProfile != NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_query_stack_explain_nested() cannot be called recursively")));
+
+    // Функция возвращает SETOF text, описание единственной колонки берём из ожидаемого
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+    initStringInfo(&command);
+    appendStringInfoString(&command, "EXPLAIN (ANALYZE");
+    if (options != NULL && options[0] != '\0')
+        appendStringInfo(&command, ", %s", options);
+    appendStringInfo(&command, ") %s", query);
+
+    // Таблица живёт в контексте вызова функции: она нужна и после SPI_finish
+    ctl.keysize = sizeof(uint64);
+    ctl.entrysize = sizeof(QueryStackNestedEntry);
+    ctl.hcxt = CurrentMemoryContext;
+    collected = hash_create("pg_query_stack nested statements", 64, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed");
+
+    // Объясняемый запрос будет добавлен в стек на текущей глубине, все более глубокие кадры - вложенные
+    NestedProfile = collected;
+    NestedContext = ctl.hcxt;
+    NestedBaseDepth = Query_Stack_Depth;
+    NestedRootPath = 0;
+
+    PG_TRY();
+    {
+        if (SPI_execute(command.data, false, 0) != SPI_OK_UTILITY)
+            elog(ERROR, "EXPLAIN failed");
+    }
+    PG_FINALLY();
+    {
+        NestedProfile = NULL;
+    }
+    PG_END_TRY();
+
+    // Сначала сам план
+    for (i = 0; i < SPI_processed; i++)
+    {
+        char       *line = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
+        Datum       value = CStringGetTextDatum(line ? line : "");
+        bool        isnull = false;
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, &value, &isnull);
+    }
+
+    SPI_finish();
+
+    // Затем дерево вложенных запросов
+    if (NestedRootPath != 0 && hash_get_num_entries(collected) > 0)
+    {
+        Datum       value = CStringGetTextDatum("Nested statements:");
+        bool        isnull = false;
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, &value, &isnull);
+
+        hash_seq_init(&status, collected);
+        while ((nentry = (QueryStackNestedEntry *) hash_seq_search(&status)) != NULL)
+            entries = lappend(entries, nentry);
+        list_sort(entries, pg_query_stack_nested_cmp);
+
+        pg_query_stack_nested_print(rsinfo, entries, NestedRootPath, 0);
+    }
+
+    PG_RETURN_VOID();
 }
\ No newline at end of file
@@ -0,0 +1,117 @@
+-- Runs on a server without pg_query_stack in shared_preload_libraries:
+-- the library is loaded by CREATE EXTENSION, cross-backend functions are unavailable.
+CREATE EXTENSION pg_query_stack;
+
+-- Frame kinds
+
+SELECT frame_number, query_text, frame_kind FROM pg_query_stack(0);
+
+-- Extended protocol: the unnamed portal of Bind is not a cursor
+SELECT frame_number, frame_kind FROM pg_query_stack(0) \bind \g
+
+CREATE FUNCTION qs_plpgsql() RETURNS SETOF text LANGUAGE plpgsql AS $$
+DECLARE
+    c refcursor;
+    r record;
+BEGIN
+    RETURN QUERY SELECT 'query ' || s.frame_number || ' ' || s.frame_kind FROM pg_query_stack(0) s;
+    FOR r IN SELECT s.frame_number, s.frame_kind FROM pg_query_stack(0) s LOOP
+        RETURN NEXT 'for ' || r.frame_number || ' ' || r.frame_kind;
+    END LOOP;
+    OPEN c FOR SELECT s.frame_number, s.frame_kind FROM pg_query_stack(0) s;
+    LOOP
+        FETCH c INTO r;
+        EXIT WHEN NOT FOUND;
+        RETURN NEXT 'open ' || r.frame_number || ' ' || r.frame_kind;
+    END LOOP;
+    CLOSE c;
+END
+$$;
+SELECT * FROM qs_plpgsql();
+
+CREATE TABLE qs_t (id integer);
+CREATE TABLE qs_log (frame_number integer, frame_kind text, trigger_name text, trigger_relation regclass);
+CREATE FUNCTION qs_trigger() RETURNS trigger LANGUAGE plpgsql AS $$
+BEGIN
+    INSERT INTO qs_log SELECT s.frame_number, s.frame_kind, s.trigger_name, s.trigger_relation FROM pg_query_stack(0) s;
+    RETURN NEW;
+END
+$$;
+CREATE TRIGGER qs_t_before BEFORE INSERT ON qs_t FOR EACH ROW EXECUTE FUNCTION qs_trigger();
+INSERT INTO qs_t VALUES (1);
+SELECT * FROM qs_log ORDER BY frame_number;
+TRUNCATE qs_log;
+
+-- The statement returning the result of an SQL function and its other statements
+CREATE FUNCTION qs_sql() RETURNS TABLE (frame_number integer, frame_kind text) LANGUAGE sql AS
+'INSERT INTO qs_log (frame_number, frame_kind) SELECT s.frame_number, s.frame_kind FROM pg_query_stack(0) s; SELECT s.frame_number, s.frame_kind FROM pg_query_stack(0) s';
+SELECT * FROM qs_sql();
+SELECT frame_number, frame_kind FROM qs_log ORDER BY frame_number;
+
+SELECT frame_number, frame_kind FROM pg_query_stack(0, 'toplevel');
+SELECT frame_number, frame_kind FROM pg_query_stack(0, 'bogus');
+
+-- Cursors closed out of order
+
+BEGIN;
+DECLARE qs_a CURSOR FOR SELECT frame_number, frame_kind FROM pg_query_stack(0);
+DECLARE qs_b CURSOR FOR SELECT frame_number, frame_kind FROM pg_query_stack(0);
+CLOSE qs_a;
+FETCH ALL FROM qs_b;
+CLOSE qs_b;
+SELECT frame_number, frame_kind FROM pg_query_stack(0);
+COMMIT;
+
+-- Frames of a rolled back subtransaction
+
+CREATE FUNCTION qs_raise() RETURNS void LANGUAGE plpgsql AS $$
+BEGIN
+    RAISE EXCEPTION 'boom';
+END
+$$;
+CREATE FUNCTION qs_catch() RETURNS SETOF text LANGUAGE plpgsql AS $$
+BEGIN
+    BEGIN
+        PERFORM qs_raise();
+    EXCEPTION WHEN OTHERS THEN
+        NULL;
+    END;
+    RETURN QUERY SELECT s.frame_number || ' ' || s.frame_kind FROM pg_query_stack(0) s;
+END
+$$;
+SELECT * FROM qs_catch();
+SELECT frame_number, frame_kind FROM pg_query_stack(0);
+
+-- Collapsing recursion
+
+CREATE FUNCTION qs_rec(n integer, collapse boolean) RETURNS SETOF text LANGUAGE plpgsql AS $$
+BEGIN
+    IF n > 0 THEN
+        RETURN QUERY SELECT * FROM qs_rec(n - 1, collapse);
+    ELSE
+        RETURN QUERY SELECT s.frame_number || ' ' || s.frame_kind || ' x' || s.repeat_count FROM pg_query_stack(0, NULL, collapse) s;
+    END IF;
+END
+$$;
+SELECT * FROM qs_rec(3, false);
+SELECT * FROM qs_rec(3, true);
+
+-- Cross-backend functions need shared memory
+
+SELECT * FROM pg_query_stack_active_frames();
+SELECT * FROM pg_query_stack_duplicates;
+SELECT * FROM pg_query_stack_horizon_blame();
+SELECT * FROM pg_query_stack_writers();
+SELECT pg_query_stack_writers_reset();
+SELECT pg_query_stack_explain(pg_backend_pid());
+SELECT * FROM pg_query_stack_shared_profile();
+SELECT pg_query_stack_shared_profile_reset();
+SELECT * FROM pg_query_stack_profile_windows();
+
+-- Session trace
+
+SELECT pg_query_stack_trace_stop();
+
+DROP TABLE qs_t, qs_log;
+DROP FUNCTION qs_plpgsql(), qs_trigger(), qs_sql(), qs_raise(), qs_catch(), qs_rec(integer, boolean);
+DROP EXTENSION pg_query_stack;